@@ -0,0 +1,384 @@
+// Allocator microbenchmarks.
+//
+// Runs one workload against whichever allocator this binary was linked
+// with (through xmalloc.h) and prints one CSV row:
+//
+//   allocator,workload,threads,ops,seconds,ops_per_sec,
+//   p50_ns,p99_ns,p999_ns,peak_rss_kb
+//
+// Every xmalloc, xfree and xrealloc call counts as one op. One op in
+// SAMPLE_EVERY is timed for the latency percentiles; the timer's own
+// cost (~20ns) is included in them. Workloads:
+//
+//   larson     threads churn random-sized blocks in slot arrays that
+//              rotate between threads, so most frees are cross-thread
+//   threadtest each thread allocates a batch of 64-byte blocks, then
+//              frees them all
+//   prodcons   threads in pairs: one allocates, the other frees
+//   churn      random sizes from 8 bytes to 8 KiB replacing random slots
+//   realloc    grow a buffer from 16 bytes to 1 MiB by doubling, free it
+//   list       build a linked list of 16-byte cells, then tear it down
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+#include "list.h"
+
+#ifndef BENCH_ALLOC
+#define BENCH_ALLOC "unknown"
+#endif
+
+#define MAX_THREADS 256
+#define SAMPLE_EVERY 8
+#define SLOTS 1024
+#define QUEUE 1024
+#define LIST_LENGTH 10000
+
+typedef struct bench_thread {
+    int       id;
+    long      ops;      // ops to do
+    long      done;     // ops done
+    unsigned  seed;
+    uint32_t* lat;      // sampled latencies in ns
+    long      nlat;
+} bench_thread;
+
+typedef struct bench_queue {
+    void*           items[QUEUE];
+    long            head;
+    long            tail;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} bench_queue;
+
+int nthreads = 1;
+bench_thread threads[MAX_THREADS];
+bench_queue queues[MAX_THREADS];
+void** larson_slots;
+pthread_barrier_t larson_barrier;
+
+static
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Starts timing an op if it is one of the sampled ones.
+static
+uint64_t
+op_start(bench_thread* bt)
+{
+    return bt->done % SAMPLE_EVERY == 0 ? now_ns() : 0;
+}
+
+static
+void
+op_end(bench_thread* bt, uint64_t t0)
+{
+    if (t0 != 0) {
+        bt->lat[bt->nlat++] = (uint32_t)(now_ns() - t0);
+    }
+    bt->done += 1;
+}
+
+static
+void*
+b_malloc(bench_thread* bt, size_t size)
+{
+    uint64_t t0 = op_start(bt);
+    void* ptr = xmalloc(size);
+    op_end(bt, t0);
+    *(char*)ptr = 1;
+    return ptr;
+}
+
+static
+void
+b_free(bench_thread* bt, void* ptr)
+{
+    uint64_t t0 = op_start(bt);
+    xfree(ptr);
+    op_end(bt, t0);
+}
+
+static
+void*
+b_realloc(bench_thread* bt, void* ptr, size_t size)
+{
+    uint64_t t0 = op_start(bt);
+    ptr = xrealloc(ptr, size);
+    op_end(bt, t0);
+    ((char*)ptr)[size - 1] = 1;
+    return ptr;
+}
+
+// Sizes spread evenly over powers of two between lo and hi.
+static
+size_t
+random_size(bench_thread* bt, int lo_bits, int hi_bits)
+{
+    int bits = lo_bits + rand_r(&(bt->seed)) % (hi_bits - lo_bits + 1);
+    return (1 << bits) + rand_r(&(bt->seed)) % (1 << bits);
+}
+
+void
+run_larson(bench_thread* bt)
+{
+    long rounds = bt->ops / (2 * SLOTS) + 1;
+    for (long rr = 0; rr < rounds; ++rr) {
+        // Each round works on another thread's slots from last round.
+        void** slots = larson_slots + ((bt->id + rr) % nthreads) * SLOTS;
+        for (int ii = 0; ii < SLOTS; ++ii) {
+            int kk = rand_r(&(bt->seed)) % SLOTS;
+            if (slots[kk]) {
+                b_free(bt, slots[kk]);
+            }
+            slots[kk] = b_malloc(bt, random_size(bt, 4, 7));
+        }
+        pthread_barrier_wait(&larson_barrier);
+    }
+}
+
+void
+run_threadtest(bench_thread* bt)
+{
+    void* blocks[SLOTS];
+    while (bt->done < bt->ops) {
+        for (int ii = 0; ii < SLOTS; ++ii) {
+            blocks[ii] = b_malloc(bt, 64);
+        }
+        for (int ii = 0; ii < SLOTS; ++ii) {
+            b_free(bt, blocks[ii]);
+        }
+    }
+}
+
+static
+void
+queue_put(bench_queue* qq, void* item)
+{
+    pthread_mutex_lock(&(qq->lock));
+    while (qq->tail - qq->head == QUEUE) {
+        pthread_cond_wait(&(qq->cond), &(qq->lock));
+    }
+    qq->items[qq->tail++ % QUEUE] = item;
+    pthread_cond_broadcast(&(qq->cond));
+    pthread_mutex_unlock(&(qq->lock));
+}
+
+static
+void*
+queue_get(bench_queue* qq)
+{
+    pthread_mutex_lock(&(qq->lock));
+    while (qq->tail == qq->head) {
+        pthread_cond_wait(&(qq->cond), &(qq->lock));
+    }
+    void* item = qq->items[qq->head++ % QUEUE];
+    pthread_cond_broadcast(&(qq->cond));
+    pthread_mutex_unlock(&(qq->lock));
+    return item;
+}
+
+void
+run_prodcons(bench_thread* bt)
+{
+    // A thread without a partner both produces and consumes.
+    if (bt->id % 2 == 0 && bt->id + 1 == nthreads) {
+        void* blocks[SLOTS];
+        while (bt->done < bt->ops) {
+            for (int ii = 0; ii < SLOTS; ++ii) {
+                blocks[ii] = b_malloc(bt, random_size(bt, 4, 8));
+            }
+            for (int ii = 0; ii < SLOTS; ++ii) {
+                b_free(bt, blocks[ii]);
+            }
+        }
+        return;
+    }
+
+    bench_queue* qq = &(queues[bt->id / 2]);
+    long items = bt->ops / 2;
+    for (long ii = 0; ii < items; ++ii) {
+        if (bt->id % 2 == 0) {
+            queue_put(qq, b_malloc(bt, random_size(bt, 4, 8)));
+        }
+        else {
+            b_free(bt, queue_get(qq));
+        }
+    }
+}
+
+void
+run_churn(bench_thread* bt)
+{
+    void* slots[SLOTS];
+    memset(slots, 0, sizeof(slots));
+    while (bt->done < bt->ops) {
+        int kk = rand_r(&(bt->seed)) % SLOTS;
+        if (slots[kk]) {
+            b_free(bt, slots[kk]);
+        }
+        slots[kk] = b_malloc(bt, random_size(bt, 3, 12));
+    }
+    for (int ii = 0; ii < SLOTS; ++ii) {
+        if (slots[ii]) {
+            xfree(slots[ii]);
+        }
+    }
+}
+
+void
+run_realloc(bench_thread* bt)
+{
+    while (bt->done < bt->ops) {
+        void* buf = b_malloc(bt, 16);
+        for (size_t size = 32; size <= (1 << 20); size *= 2) {
+            buf = b_realloc(bt, buf, size);
+        }
+        b_free(bt, buf);
+    }
+}
+
+void
+run_list(bench_thread* bt)
+{
+    while (bt->done < bt->ops) {
+        cell* xs = 0;
+        for (long ii = 0; ii < LIST_LENGTH; ++ii) {
+            uint64_t t0 = op_start(bt);
+            xs = cons(ii, xs);
+            op_end(bt, t0);
+        }
+        while (xs) {
+            cell* ys = xs->rest;
+            b_free(bt, xs);
+            xs = ys;
+        }
+    }
+}
+
+typedef struct bench_workload {
+    const char* name;
+    void (*run)(bench_thread* bt);
+} bench_workload;
+
+bench_workload workloads[] = {
+    {"larson", run_larson},
+    {"threadtest", run_threadtest},
+    {"prodcons", run_prodcons},
+    {"churn", run_churn},
+    {"realloc", run_realloc},
+    {"list", run_list},
+};
+
+bench_workload* workload;
+
+void*
+worker(void* arg)
+{
+    workload->run((bench_thread*)arg);
+    return 0;
+}
+
+static
+int
+cmp_u32(const void* aa, const void* bb)
+{
+    uint32_t xx = *(const uint32_t*)aa;
+    uint32_t yy = *(const uint32_t*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3 || argc > 4) {
+        printf("Usage:\n");
+        printf("\t%s WORKLOAD THREADS [OPS_PER_THREAD]\n", argv[0]);
+        printf("Workloads:");
+        for (size_t ii = 0; ii < sizeof(workloads) / sizeof(workloads[0]); ++ii) {
+            printf(" %s", workloads[ii].name);
+        }
+        printf("\n");
+        return 1;
+    }
+
+    workload = 0;
+    for (size_t ii = 0; ii < sizeof(workloads) / sizeof(workloads[0]); ++ii) {
+        if (strcmp(argv[1], workloads[ii].name) == 0) {
+            workload = &(workloads[ii]);
+        }
+    }
+    nthreads = atoi(argv[2]);
+    long ops = argc == 4 ? atol(argv[3]) : 100000;
+    if (workload == 0 || nthreads < 1 || nthreads > MAX_THREADS || ops < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+
+    // Latency samples live outside the allocator being measured.
+    long cap = ops / SAMPLE_EVERY + 2 * (LIST_LENGTH + SLOTS + 64);
+    uint32_t* lat = mmap(0, nthreads * cap * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    larson_slots = mmap(0, nthreads * SLOTS * sizeof(void*), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pthread_barrier_init(&larson_barrier, 0, nthreads);
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        threads[ii].id = ii;
+        threads[ii].ops = ops;
+        threads[ii].done = 0;
+        threads[ii].seed = ii * 7919 + 1;
+        threads[ii].lat = lat + ii * cap;
+        threads[ii].nlat = 0;
+        pthread_mutex_init(&(queues[ii].lock), 0);
+        pthread_cond_init(&(queues[ii].cond), 0);
+    }
+
+    pthread_t tids[MAX_THREADS];
+    uint64_t t0 = now_ns();
+    for (int ii = 0; ii < nthreads; ++ii) {
+        pthread_create(&(tids[ii]), 0, worker, &(threads[ii]));
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        pthread_join(tids[ii], 0);
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    for (int ii = 0; ii < nthreads * SLOTS; ++ii) {
+        if (larson_slots[ii]) {
+            xfree(larson_slots[ii]);
+        }
+    }
+
+    // Gather the samples in one run for the percentiles.
+    long total_ops = 0;
+    long nlat = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        total_ops += threads[ii].done;
+        memmove(lat + nlat, threads[ii].lat, threads[ii].nlat * sizeof(uint32_t));
+        nlat += threads[ii].nlat;
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%s,%s,%d,%ld,%.4f,%.0f,%u,%u,%u,%ld\n",
+           BENCH_ALLOC, workload->name, nthreads, total_ops, seconds,
+           total_ops / seconds,
+           lat[nlat * 50 / 100], lat[nlat * 99 / 100], lat[nlat * 999 / 1000],
+           usage.ru_maxrss);
+    return 0;
+}
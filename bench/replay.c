@@ -0,0 +1,414 @@
+// Replays an allocation trace recorded with libxtrace.so against
+// whichever allocator this binary was linked with (through xmalloc.h),
+// and prints one CSV row:
+//
+//   allocator,trace,threads,events,seconds,events_per_sec,
+//   peak_live_kb,peak_rss_kb,fragmentation
+//
+// The events are put in recorded order and every block gets an id of
+// its own, since the recorded addresses are reused. Each recorded thread
+// is replayed by a thread of its own, in its recorded order; a free or
+// realloc of a block another thread allocated waits until that
+// allocation has been replayed. With -s every event also waits for all
+// the events recorded before it, which keeps the recorded interleaving
+// exactly but runs one event at a time.
+//
+// peak_live_kb is the most the program had asked for at once, and
+// peak_rss_kb how far resident memory grew during the replay; their
+// ratio is the fragmentation. Every page of each block is touched, as
+// the program presumably did. Aligned allocations are replayed as plain
+// ones, since xmalloc.h has no aligned entry point, and frees of blocks
+// allocated before tracing started are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+#ifndef BENCH_ALLOC
+#define BENCH_ALLOC "unknown"
+#endif
+
+enum replay_kind {
+    RE_MALLOC,
+    RE_CALLOC,
+    RE_FREE,
+    RE_REALLOC,
+};
+
+typedef struct replay_op {
+    int  kind;
+    int  thread;
+    long id;      // block made: malloc, calloc, realloc
+    long from;    // block used up: free, realloc
+    long size;
+    long seq;     // position in recorded order
+} replay_op;
+
+typedef struct replay_thread {
+    replay_op* ops;
+    long       count;
+} replay_thread;
+
+int strict = 0;
+long turn = 0;
+void** blocks;
+
+// Memory for the replay's own tables comes straight from the kernel, so
+// the allocator being measured only sees the trace.
+static
+void*
+table_alloc(size_t bytes)
+{
+    void* ptr = mmap(0, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+static
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Frees come before allocations at the same time, so that a block freed
+// and handed out again by another thread in the same ns keeps its order.
+static
+int
+cmp_event(const void* aa, const void* bb)
+{
+    const xtrace_event* xx = aa;
+    const xtrace_event* yy = bb;
+    if (xx->time != yy->time) {
+        return xx->time < yy->time ? -1 : 1;
+    }
+    int xfree_first = xx->op == XT_FREE || xx->op == XT_REALLOC_FROM;
+    int yfree_first = yy->op == XT_FREE || yy->op == XT_REALLOC_FROM;
+    if (xfree_first != yfree_first) {
+        return xfree_first ? -1 : 1;
+    }
+    return (xx->thread > yy->thread) - (xx->thread < yy->thread);
+}
+
+// Live blocks by recorded address, open addressing with tombstones.
+typedef struct addr_map {
+    uint64_t* keys;   // 0 empty, 1 deleted
+    long*     ids;
+    long      mask;
+} addr_map;
+
+static
+long*
+map_find(addr_map* mm, uint64_t key, int insert)
+{
+    long ii = (long)((key >> 4) * 0x9e3779b97f4a7c15ULL >> 20) & mm->mask;
+    long tomb = -1;
+    while (mm->keys[ii] != 0) {
+        if (mm->keys[ii] == key) {
+            return &(mm->ids[ii]);
+        }
+        if (mm->keys[ii] == 1 && tomb < 0) {
+            tomb = ii;
+        }
+        ii = (ii + 1) & mm->mask;
+    }
+    if (!insert) {
+        return 0;
+    }
+    if (tomb >= 0) {
+        ii = tomb;
+    }
+    mm->keys[ii] = key;
+    return &(mm->ids[ii]);
+}
+
+static
+long
+map_take(addr_map* mm, uint64_t key)
+{
+    long* id = map_find(mm, key, 0);
+    if (!id) {
+        return -1;
+    }
+    long found = *id;
+    mm->keys[id - mm->ids] = 1;
+    return found;
+}
+
+static
+void
+touch(void* ptr, long size)
+{
+    for (long off = 0; off < size; off += 4096) {
+        ((volatile char*)ptr)[off] = 1;
+    }
+}
+
+static
+void*
+wait_block(long id)
+{
+    void* ptr;
+    while (!(ptr = __atomic_load_n(&(blocks[id]), __ATOMIC_ACQUIRE))) {
+        sched_yield();
+    }
+    return ptr;
+}
+
+void*
+replayer(void* arg)
+{
+    replay_thread* rt = arg;
+    for (long ii = 0; ii < rt->count; ++ii) {
+        replay_op* op = &(rt->ops[ii]);
+        if (strict) {
+            while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != op->seq) {
+                sched_yield();
+            }
+        }
+
+        void* ptr = 0;
+        switch (op->kind) {
+        case RE_MALLOC:
+            ptr = xmalloc(op->size);
+            break;
+        case RE_CALLOC:
+            ptr = xcalloc(1, op->size);
+            break;
+        case RE_FREE:
+            xfree(wait_block(op->from));
+            break;
+        case RE_REALLOC:
+            ptr = xrealloc(wait_block(op->from), op->size);
+            break;
+        }
+        if (ptr) {
+            touch(ptr, op->size);
+            __atomic_store_n(&(blocks[op->id]), ptr, __ATOMIC_RELEASE);
+        }
+
+        if (strict) {
+            __atomic_store_n(&turn, op->seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+static
+long
+resident_kb(const char* field)
+{
+    char buf[4096];
+    int fd = open("/proc/self/status", O_RDONLY);
+    long nn = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (nn <= 0) {
+        return 0;
+    }
+    buf[nn] = 0;
+    char* line = strstr(buf, field);
+    return line ? atol(line + strlen(field)) : 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int argi = 1;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        strict = 1;
+        argi++;
+    }
+    if (argi + 1 != argc) {
+        printf("Usage:\n");
+        printf("\t%s [-s] TRACE\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[argi];
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 1;
+    }
+    xtrace_header hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+        || memcmp(hdr.magic, XTRACE_MAGIC, sizeof(hdr.magic)) != 0
+        || hdr.event_size != sizeof(xtrace_event)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 1;
+    }
+
+    // Load and order the events.
+    long nevents = (st.st_size - sizeof(hdr)) / sizeof(xtrace_event);
+    size_t events_bytes = nevents * sizeof(xtrace_event);
+    xtrace_event* events = table_alloc(events_bytes);
+    size_t got = 0;
+    while (got < events_bytes) {
+        ssize_t nn = read(fd, (char*)events + got, events_bytes - got);
+        if (nn <= 0) {
+            break;
+        }
+        got += nn;
+    }
+    close(fd);
+    nevents = got / sizeof(xtrace_event);
+    qsort(events, nevents, sizeof(xtrace_event), cmp_event);
+
+    // Give every block an id, and turn the events into ops.
+    addr_map map;
+    map.mask = 1;
+    while (map.mask < 2 * nevents) {
+        map.mask *= 2;
+    }
+    map.keys = table_alloc(map.mask * sizeof(uint64_t));
+    map.ids = table_alloc(map.mask * sizeof(long));
+    map.mask -= 1;
+
+    replay_op* ops = table_alloc(nevents * sizeof(replay_op));
+    long* sizes = table_alloc(nevents * sizeof(long));
+    long nthreads = 0;
+    for (long ii = 0; ii < nevents; ++ii) {
+        if (events[ii].thread >= nthreads) {
+            nthreads = events[ii].thread + 1;
+        }
+    }
+    long* pending = table_alloc(nthreads * sizeof(long));
+    long nops = 0;
+    long nids = 0;
+    long live = 0;
+    long peak_live = 0;
+
+    for (long ii = 0; ii < nevents; ++ii) {
+        xtrace_event* ev = &(events[ii]);
+        replay_op* op = &(ops[nops]);
+        op->thread = ev->thread;
+        op->seq = nops;
+        op->id = -1;
+        op->from = -1;
+        op->size = ev->size;
+
+        switch (ev->op) {
+        case XT_MALLOC:
+        case XT_MEMALIGN:
+        case XT_CALLOC:
+            op->kind = ev->op == XT_CALLOC ? RE_CALLOC : RE_MALLOC;
+            op->id = nids++;
+            break;
+        case XT_FREE:
+            op->kind = RE_FREE;
+            op->from = map_take(&map, ev->ptr);
+            break;
+        case XT_REALLOC_FROM:
+            pending[ev->thread] = map_take(&map, ev->ptr);
+            continue;
+        case XT_REALLOC_TO:
+            op->from = pending[ev->thread];
+            if (ev->ptr == 0) {
+                op->kind = RE_FREE;
+            }
+            else {
+                op->kind = op->from < 0 ? RE_MALLOC : RE_REALLOC;
+                op->id = nids++;
+            }
+            break;
+        default:
+            continue;
+        }
+
+        if (op->kind == RE_FREE && op->from < 0) {
+            continue;
+        }
+        if (op->from >= 0) {
+            live -= sizes[op->from];
+        }
+        if (op->id >= 0) {
+            if (op->size == 0) {
+                op->size = 1;
+            }
+            *map_find(&map, ev->ptr, 1) = op->id;
+            sizes[op->id] = op->size;
+            live += op->size;
+        }
+        if (live > peak_live) {
+            peak_live = live;
+        }
+        nops++;
+    }
+    munmap(events, events_bytes ? events_bytes : 1);
+    munmap(map.keys, (map.mask + 1) * sizeof(uint64_t));
+    munmap(map.ids, (map.mask + 1) * sizeof(long));
+
+    // Split the ops by thread, keeping their order.
+    replay_thread* threads = table_alloc(nthreads * sizeof(replay_thread));
+    replay_op* by_thread = table_alloc(nops * sizeof(replay_op));
+    for (long ii = 0; ii < nops; ++ii) {
+        threads[ops[ii].thread].count++;
+    }
+    long start = 0;
+    for (long tt = 0; tt < nthreads; ++tt) {
+        threads[tt].ops = by_thread + start;
+        start += threads[tt].count;
+        threads[tt].count = 0;
+    }
+    for (long ii = 0; ii < nops; ++ii) {
+        replay_thread* rt = &(threads[ops[ii].thread]);
+        rt->ops[rt->count++] = ops[ii];
+    }
+    munmap(ops, nops * sizeof(replay_op));
+    blocks = table_alloc(nids * sizeof(void*));
+    memset(blocks, 0, nids * sizeof(void*)); // fault it in before measuring
+
+    // Start the peak RSS over from here, so it covers only the replay.
+    int clear = open("/proc/self/clear_refs", O_WRONLY);
+    if (clear >= 0) {
+        if (write(clear, "5", 1) != 1) {
+            perror("clear_refs");
+        }
+        close(clear);
+    }
+    long base_kb = resident_kb("VmRSS:");
+
+    pthread_t* tids = table_alloc(nthreads * sizeof(pthread_t));
+    long running = 0;
+    uint64_t t0 = now_ns();
+    for (long tt = 0; tt < nthreads; ++tt) {
+        if (threads[tt].count > 0) {
+            pthread_create(&(tids[tt]), 0, replayer, &(threads[tt]));
+            running++;
+        }
+    }
+    for (long tt = 0; tt < nthreads; ++tt) {
+        if (threads[tt].count > 0) {
+            pthread_join(tids[tt], 0);
+        }
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    long peak_kb = resident_kb("VmHWM:") - base_kb;
+    long live_kb = (peak_live + 1023) / 1024;
+    printf("%s,%s,%ld,%ld,%.4f,%.0f,%ld,%ld,%.2f\n",
+           BENCH_ALLOC, path, running, nops, seconds, nops / seconds,
+           live_kb, peak_kb, live_kb > 0 ? (double)peak_kb / live_kb : 0.0);
+    return 0;
+}
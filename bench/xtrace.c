@@ -0,0 +1,354 @@
+// Allocation trace recorder, for use as
+//
+//   XTRACE_OUT=app.trace LD_PRELOAD=./bench/libxtrace.so some-program
+//
+// Wraps the libc allocator and logs every call as an xtrace_event (see
+// xtrace.h) for bench/replay. Each thread appends to its own mmap'd
+// buffer under that buffer's lock, which only the exit flush ever
+// contends; a full buffer is written out with one write(2), and the
+// partly full ones when their thread or the process exits. A thread's
+// buffer is kept for the next new thread when it exits, never unmapped.
+// The trace goes to XTRACE_OUT, or xtrace.PID by default. Forked
+// children are not traced.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "xtrace.h"
+
+extern void* __libc_malloc(size_t bytes);
+extern void  __libc_free(void* ptr);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* prev, size_t bytes);
+extern void* __libc_memalign(size_t align, size_t bytes);
+
+#define BUFFER_EVENTS 32768
+#define MAX_BUFFERS 4096
+
+typedef struct trace_buffer {
+    pthread_mutex_t lock;  // taken before trace_lock
+    int           in_use;  // owned by a live thread; under trace_lock
+    int           count;
+    uint32_t      thread;
+    uint64_t      last;    // time of the last event
+    xtrace_event  events[BUFFER_EVENTS];
+} trace_buffer;
+
+static __thread trace_buffer* my_buffer __attribute__((tls_model("initial-exec")));
+static trace_buffer* buffers[MAX_BUFFERS];
+static uint32_t next_thread = 0;
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static int trace_key_ready = 0;
+
+static
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Writes out a buffer's events. Events from before the trace file was
+// opened, at startup, are dropped if the buffer fills first. Caller
+// holds tb->lock.
+static
+void
+flush_buffer(trace_buffer* tb)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0 && tb->count > 0) {
+        size_t bytes = tb->count * sizeof(xtrace_event);
+        if (write(trace_fd, tb->events, bytes) != (ssize_t)bytes) {
+            close(trace_fd);
+            trace_fd = -1;
+        }
+    }
+    tb->count = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static
+void
+drop_buffer(void* arg)
+{
+    trace_buffer* tb = arg;
+    pthread_mutex_lock(&tb->lock);
+    flush_buffer(tb);
+    pthread_mutex_unlock(&tb->lock);
+    pthread_mutex_lock(&trace_lock);
+    tb->in_use = 0;
+    pthread_mutex_unlock(&trace_lock);
+    my_buffer = 0;
+}
+
+static
+trace_buffer*
+new_buffer()
+{
+    pthread_mutex_lock(&trace_lock);
+    int slot = 0;
+    while (slot < MAX_BUFFERS && buffers[slot] && buffers[slot]->in_use) {
+        slot++;
+    }
+    if (slot == MAX_BUFFERS) {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+    trace_buffer* tb = buffers[slot];
+    if (!tb) {
+        tb = mmap(0, sizeof(trace_buffer), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tb == MAP_FAILED) {
+            pthread_mutex_unlock(&trace_lock);
+            return 0;
+        }
+        pthread_mutex_init(&tb->lock, 0);
+        __atomic_store_n(&buffers[slot], tb, __ATOMIC_RELEASE);
+    }
+    tb->in_use = 1;
+    tb->thread = next_thread++;
+    pthread_mutex_unlock(&trace_lock);
+
+    my_buffer = tb;
+    if (trace_key_ready) {
+        pthread_setspecific(trace_key, tb);
+    }
+    return tb;
+}
+
+// Logs an event that happened at time tt.
+static
+void
+record_at(uint64_t tt, int op, void* ptr, size_t size, int align)
+{
+    trace_buffer* tb = my_buffer;
+    if (!tb && !(tb = new_buffer())) {
+        return;
+    }
+
+    pthread_mutex_lock(&tb->lock);
+    if (tt <= tb->last) {
+        tt = tb->last + 1;
+    }
+    tb->last = tt;
+
+    xtrace_event* ev = &(tb->events[tb->count++]);
+    ev->time = tt;
+    ev->ptr = (uint64_t)ptr;
+    ev->size = size;
+    ev->thread = tb->thread;
+    ev->op = op;
+    ev->align = align;
+    ev->_pad = 0;
+
+    if (tb->count == BUFFER_EVENTS) {
+        flush_buffer(tb);
+    }
+    pthread_mutex_unlock(&tb->lock);
+}
+
+static
+void
+record(int op, void* ptr, size_t size, int align)
+{
+    record_at(now_ns(), op, ptr, size, align);
+}
+
+static
+void
+fork_child()
+{
+    for (int ii = 0; ii < MAX_BUFFERS; ++ii) {
+        if (buffers[ii]) {
+            buffers[ii]->count = 0;
+        }
+    }
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+__attribute__((constructor))
+static
+void
+trace_start()
+{
+    char name[64];
+    const char* path = getenv("XTRACE_OUT");
+    if (!path) {
+        snprintf(name, sizeof(name), "xtrace.%d", (int)getpid());
+        path = name;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("xtrace: open");
+        return;
+    }
+    xtrace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, XTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.event_size = sizeof(xtrace_event);
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return;
+    }
+
+    pthread_key_create(&trace_key, drop_buffer);
+    trace_key_ready = 1;
+    if (my_buffer) {
+        pthread_setspecific(trace_key, my_buffer);
+    }
+    pthread_atfork(0, 0, fork_child);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Other threads may still be running. Buffers are never unmapped, and
+// each is flushed under its lock, so they can go on recording; whatever
+// they log from here on is lost unless it fills a buffer.
+__attribute__((destructor))
+static
+void
+trace_stop()
+{
+    if (trace_fd < 0) {
+        return;
+    }
+    for (int ii = 0; ii < MAX_BUFFERS; ++ii) {
+        trace_buffer* tb = __atomic_load_n(&buffers[ii], __ATOMIC_ACQUIRE);
+        if (tb) {
+            pthread_mutex_lock(&tb->lock);
+            flush_buffer(tb);
+            pthread_mutex_unlock(&tb->lock);
+        }
+    }
+}
+
+static
+int
+log2_align(size_t align)
+{
+    return align ? __builtin_ctzl(align) : 0;
+}
+
+void*
+malloc(size_t bytes)
+{
+    void* ptr = __libc_malloc(bytes);
+    if (ptr) {
+        record(XT_MALLOC, ptr, bytes, 0);
+    }
+    return ptr;
+}
+
+void
+free(void* ptr)
+{
+    if (ptr) {
+        record(XT_FREE, ptr, 0, 0);
+    }
+    __libc_free(ptr);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+    void* ptr = __libc_calloc(nmemb, size);
+    if (ptr) {
+        record(XT_CALLOC, ptr, nmemb * size, 0);
+    }
+    return ptr;
+}
+
+void*
+realloc(void* prev, size_t bytes)
+{
+    if (!prev) {
+        return malloc(bytes);
+    }
+    // The start is stamped before the call, so that it sorts ahead of
+    // another thread reusing prev, but only logged once the call has
+    // succeeded: a failed realloc leaves prev alone and is not traced.
+    // A NULL for 0 bytes means prev was freed.
+    uint64_t tt = now_ns();
+    void* ptr = __libc_realloc(prev, bytes);
+    if (ptr || bytes == 0) {
+        record_at(tt, XT_REALLOC_FROM, prev, 0, 0);
+        record(XT_REALLOC_TO, ptr, bytes, 0);
+    }
+    return ptr;
+}
+
+void*
+reallocarray(void* prev, size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return realloc(prev, bytes);
+}
+
+static
+void*
+traced_memalign(size_t align, size_t bytes)
+{
+    void* ptr = __libc_memalign(align, bytes);
+    if (ptr) {
+        record(XT_MEMALIGN, ptr, bytes, log2_align(align));
+    }
+    return ptr;
+}
+
+int
+posix_memalign(void** out, size_t align, size_t bytes)
+{
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void* ptr = traced_memalign(align, bytes);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void*
+aligned_alloc(size_t align, size_t bytes)
+{
+    return traced_memalign(align, bytes);
+}
+
+void*
+memalign(size_t align, size_t bytes)
+{
+    return traced_memalign(align, bytes);
+}
+
+void*
+valloc(size_t bytes)
+{
+    return traced_memalign(getpagesize(), bytes);
+}
+
+void*
+pvalloc(size_t bytes)
+{
+    size_t page = getpagesize();
+    return traced_memalign(page, (bytes + page - 1) & ~(page - 1));
+}
@@ -0,0 +1,44 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+#include <stdint.h>
+
+// Allocation trace format, written by libxtrace.so and read by replay.
+//
+// A trace is an xtrace_header followed by blocks of events. Each thread
+// writes its own blocks, so events of different threads are interleaved
+// only block by block, and are put back in order by their time. Times
+// are taken before a free and after an allocation returns, and are
+// strictly increasing within a thread, so a block that is freed and
+// handed out again always shows the free first. A realloc is two
+// events: the old block let go before the call and the new one got
+// after it.
+
+#define XTRACE_MAGIC "XTRACE1"
+
+typedef struct xtrace_header {
+    char     magic[8];
+    uint32_t event_size;
+    uint32_t _pad;
+} xtrace_header;
+
+enum xtrace_op {
+    XT_MALLOC = 1,    // ptr = malloc(size)
+    XT_CALLOC,        // ptr = calloc(1, size)
+    XT_MEMALIGN,      // ptr = aligned to 1 << align
+    XT_FREE,          // free(ptr)
+    XT_REALLOC_FROM,  // realloc of ptr starts
+    XT_REALLOC_TO,    // and returned ptr, size bytes
+};
+
+typedef struct xtrace_event {
+    uint64_t time;    // CLOCK_MONOTONIC, in ns
+    uint64_t ptr;
+    uint64_t size;
+    uint32_t thread;
+    uint8_t  op;
+    uint8_t  align;
+    uint16_t _pad;
+} xtrace_event;
+
+#endif
@@ -0,0 +1,164 @@
+// Generates size_classes.h, omem's slab size classes, for one scheme:
+//
+//   legacy    the original 16 hand-picked classes
+//   pow2      powers of two, fewest classes, up to 50% rounding waste
+//   wasteN    as few classes as keep rounding waste at or under N%,
+//             e.g. waste12.5 or waste25
+//
+// Every class is a multiple of 16 up to SLAB_MAX. A slab chunk is
+// SLAB_CHUNK_SIZE bytes starting with a SLAB_CHUNK_HEADER-byte descriptor,
+// and its objects are naturally aligned, so some sizes leave more of the
+// chunk unused than others; wasteN takes the largest size within its
+// rounding bound whose chunk waste is within it too, when there is one.
+// Along with the sizes the header gets the size-to-class lookup and the
+// offset and number of objects in each class's chunks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_MAX 512
+#define SLAB_CHUNK_SIZE 4096
+#define SLAB_CHUNK_HEADER 80
+#define MAX_CLASSES 62
+
+static const long legacy[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+long sizes[MAX_CLASSES];
+int count = 0;
+
+static
+long
+chunk_start(long size)
+{
+    long align = size & -size;
+    return (SLAB_CHUNK_HEADER + align - 1) & ~(align - 1);
+}
+
+static
+long
+chunk_objects(long size)
+{
+    return (SLAB_CHUNK_SIZE - chunk_start(size)) / size;
+}
+
+// Share of a chunk that is neither descriptor nor objects.
+static
+double
+chunk_waste(long size)
+{
+    long unused = SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER - chunk_objects(size) * size;
+    return (double)unused / SLAB_CHUNK_SIZE;
+}
+
+static
+void
+add_class(long size)
+{
+    if (count == MAX_CLASSES) {
+        fprintf(stderr, "gen_classes: more than %d classes\n", MAX_CLASSES);
+        exit(1);
+    }
+    sizes[count++] = size;
+}
+
+static
+void
+bounded(double waste)
+{
+    add_class(16);
+    while (sizes[count - 1] < SLAB_MAX) {
+        long prev = sizes[count - 1];
+        // A request of prev + 1 rounds up to the next class, wasting
+        // (next - prev - 1) / next of it.
+        long next = prev + 16;
+        while (next + 16 <= SLAB_MAX && (double)(next + 16 - prev - 1) / (next + 16) <= waste) {
+            next += 16;
+        }
+        long pick = next;
+        while (pick > prev + 16 && chunk_waste(pick) > waste) {
+            pick -= 16;
+        }
+        add_class(chunk_waste(pick) <= waste ? pick : next);
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* scheme = argc > 1 ? argv[1] : "waste12.5";
+
+    if (strcmp(scheme, "legacy") == 0) {
+        for (size_t ii = 0; ii < sizeof(legacy) / sizeof(legacy[0]); ++ii) {
+            add_class(legacy[ii]);
+        }
+    }
+    else if (strcmp(scheme, "pow2") == 0) {
+        for (long size = 16; size <= SLAB_MAX; size *= 2) {
+            add_class(size);
+        }
+    }
+    else if (strncmp(scheme, "waste", 5) == 0 && atof(scheme + 5) > 0) {
+        bounded(atof(scheme + 5) / 100);
+    }
+    else {
+        fprintf(stderr, "Usage: %s legacy|pow2|wasteN\n", argv[0]);
+        return 1;
+    }
+
+    double worst_round = 0;
+    double worst_chunk = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        long prev = ii == 0 ? 0 : sizes[ii - 1];
+        double round = (double)(sizes[ii] - prev - 1) / sizes[ii];
+        if (sizes[ii] - prev > 16 && round > worst_round) {
+            worst_round = round;
+        }
+        if (chunk_waste(sizes[ii]) > worst_chunk) {
+            worst_chunk = chunk_waste(sizes[ii]);
+        }
+    }
+
+    printf("// Generated by gen_classes %s; do not edit.\n", scheme);
+    printf("// %d classes. Beyond the 16-byte granularity, requests lose at most\n", count);
+    printf("// %.1f%% to rounding, and slab chunks at most %.1f%% to slack.\n",
+           100 * worst_round, 100 * worst_chunk);
+    printf("#define SIZE_CLASS_SCHEME \"%s\"\n", scheme);
+    printf("#define SLAB_CLASSES %d\n", count);
+    printf("#define SLAB_MAX %d\n", SLAB_MAX);
+    printf("#define SLAB_CHUNK_SIZE %d\n", SLAB_CHUNK_SIZE);
+    printf("#define SLAB_CHUNK_HEADER %d\n", SLAB_CHUNK_HEADER);
+
+    printf("\nstatic const int64_t slab_sizes[SLAB_CLASSES] = {");
+    for (int ii = 0; ii < count; ++ii) {
+        printf("%s%ld,", ii % 12 == 0 ? "\n    " : " ", sizes[ii]);
+    }
+    printf("\n};\n");
+
+    printf("\n// Offset of the first object in a slab chunk of each class, and how\n");
+    printf("// many objects fit.\n");
+    printf("static const int16_t slab_start[SLAB_CLASSES] = {");
+    for (int ii = 0; ii < count; ++ii) {
+        printf("%s%ld,", ii % 12 == 0 ? "\n    " : " ", chunk_start(sizes[ii]));
+    }
+    printf("\n};\n");
+    printf("static const int16_t slab_objects[SLAB_CLASSES] = {");
+    for (int ii = 0; ii < count; ++ii) {
+        printf("%s%ld,", ii % 12 == 0 ? "\n    " : " ", chunk_objects(sizes[ii]));
+    }
+    printf("\n};\n");
+
+    printf("\n// Size class for each 16-byte step up to SLAB_MAX.\n");
+    printf("static const unsigned char slab_class_of[SLAB_MAX / 16 + 1] = {");
+    int cls = 0;
+    for (int ii = 0; ii <= SLAB_MAX / 16; ++ii) {
+        while (sizes[cls] < ii * 16) {
+            cls++;
+        }
+        printf("%s%d,", ii % 16 == 0 ? "\n    " : " ", cls);
+    }
+    printf("\n};\n");
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "hmem.h"
 
@@ -27,6 +28,9 @@ static nu_free_cell* nu_free_list = 0;
 
 static long nu_malloc_chunks = 0;
 static long nu_free_chunks = 0;
+static long nu_pages_mapped = 0;
+static long nu_pages_unmapped = 0;
+static int nu_stats_init = 0;
 
 int64_t
 nu_free_list_length()
@@ -57,7 +61,6 @@ void
 nu_free_list_coalesce()
 {
     nu_free_cell* pp = nu_free_list;
-    int free_chunk = 0;
 
     while (pp != 0 && pp->next != 0) {
         if (((int64_t)pp) + pp->size == ((int64_t) pp->next)) {
@@ -112,6 +115,7 @@ nu_free_cell*
 make_cell()
 {
     void* addr = mmap(0, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    nu_pages_mapped += CHUNK_SIZE / 4096;
     nu_free_cell* cell = (nu_free_cell*) addr; 
     cell->size = CHUNK_SIZE;
     return cell;
@@ -121,6 +125,14 @@ void*
 hmalloc(size_t usize)
 {
     pthread_mutex_lock(&lock);
+    if (!nu_stats_init) {
+        // HMEM_STATS=1 prints hprintstats() at exit.
+        char* env = getenv("HMEM_STATS");
+        if (env && atoi(env)) {
+            atexit(hprintstats);
+        }
+        nu_stats_init = 1;
+    }
     int64_t size = (int64_t) usize;
 
     // space for size
@@ -136,6 +148,8 @@ hmalloc(size_t usize)
         void* addr = mmap(0, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         *((int64_t*)addr) = alloc_size;
         nu_malloc_chunks += 1;
+        nu_pages_mapped += (alloc_size + 4095) / 4096;
+        pthread_mutex_unlock(&lock);
         return addr + sizeof(int64_t);
     }
 
@@ -167,6 +181,7 @@ hfree(void* addr)
 
     if (size > CHUNK_SIZE) {
         nu_free_chunks += 1;
+        nu_pages_unmapped += (size + 4095) / 4096;
         munmap((void*) cell, size);
     }
     else {
@@ -179,7 +194,37 @@ hfree(void* addr)
 void* hrealloc(void* prev, size_t bytes)
 {
     void* newaddr = hmalloc(bytes);
-    memcpy(newaddr, prev, bytes);
-    hfree(prev);
+    if (prev) {
+        // Copy no more than the old block holds.
+        size_t size = *((int64_t*)(prev - sizeof(int64_t))) - sizeof(int64_t);
+        memcpy(newaddr, prev, size < bytes ? size : bytes);
+        hfree(prev);
+    }
     return newaddr;
 }
+
+hm_stats*
+hgetstats()
+{
+    static hm_stats stats;
+    pthread_mutex_lock(&lock);
+    stats.pages_mapped = nu_pages_mapped;
+    stats.pages_unmapped = nu_pages_unmapped;
+    stats.chunks_allocated = nu_malloc_chunks;
+    stats.chunks_freed = nu_free_chunks;
+    stats.free_length = nu_free_list_length();
+    pthread_mutex_unlock(&lock);
+    return &stats;
+}
+
+void
+hprintstats()
+{
+    hm_stats* stats = hgetstats();
+    fprintf(stderr, "\n== husky malloc stats ==\n");
+    fprintf(stderr, "Mapped:   %ld\n", stats->pages_mapped);
+    fprintf(stderr, "Unmapped: %ld\n", stats->pages_unmapped);
+    fprintf(stderr, "Allocs:   %ld\n", stats->chunks_allocated);
+    fprintf(stderr, "Frees:    %ld\n", stats->chunks_freed);
+    fprintf(stderr, "Freelen:  %ld\n", stats->free_length);
+}
@@ -1,6 +1,9 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+#include <pthread.h>
+
 #include "xmalloc.h"
 
 // Linked list cell.
@@ -9,11 +12,30 @@ typedef struct cell {
     struct cell* rest;
 } cell;
 
+// All cells come from one pool, created on first use.
+static xpool* cell_pool = 0;
+static pthread_once_t cell_pool_once = PTHREAD_ONCE_INIT;
+
+static
+void
+cell_pool_init()
+{
+    cell_pool = xpool_create(sizeof(cell));
+}
+
+static
+xpool*
+list_pool()
+{
+    pthread_once(&cell_pool_once, cell_pool_init);
+    return cell_pool;
+}
+
 static
 cell*
 cons(long item, cell* rest)
 {
-    cell* xs = xmalloc(sizeof(cell));
+    cell* xs = xpool_alloc(list_pool());
     xs->item = item;
     xs->rest = rest;
     return xs;
@@ -35,10 +57,8 @@ static
 void
 free_list(cell* xs)
 {
-    while (xs) {
-        cell* ys = xs->rest;
-        xfree(xs);
-        xs = ys;
+    if (xs) {
+        xpool_free_chain(list_pool(), xs, offsetof(cell, rest));
     }
 }
 
@@ -46,13 +66,22 @@ static
 cell*
 copy_list(cell* xs)
 {
-    if (xs == 0) {
-        return 0;
-    }
+    // Take all the cells at once, linked through their first word, and
+    // fill them in front to back.
+    cell* fresh = xpool_alloc_chain(list_pool(), count_list(xs));
+    cell* ys = 0;
+    cell** tail = &ys;
 
-    cell* ys = copy_list(xs->rest);
-    return cons(xs->item, ys);
+    while (xs) {
+        cell* zs = fresh;
+        fresh = *(cell**)fresh;
+        zs->item = xs->item;
+        zs->rest = 0;
+        *tail = zs;
+        tail = &(zs->rest);
+        xs = xs->rest;
+    }
+    return ys;
 }
 
 #endif
-
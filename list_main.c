@@ -15,26 +15,45 @@
 //  - calculate the length of the sequence 
 // Next
 
+// Scheduling: each thread owns a deque of task indices. It works on
+// the task at the back of its own deque, 50 steps at a time, putting it
+// back until its sequence reaches 1. A thread with an empty deque
+// steals half of another thread's deque from the front.
+
 #include <stdio.h>
 #include <pthread.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sched.h>
 
 #include "xmalloc.h"
 #include "list.h"
 
-#define THREADS 4
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 256
 
 typedef struct num_task {
     cell* vals;
     long  steps;
-    int   dibs;
-    pthread_mutex_t lock;
 } num_task;
 
+// A thread's queue of task indices. The owner pushes and pops at the
+// tail, thieves take from the head. Padded to a cache line so threads
+// don't share one.
+typedef struct task_deque {
+    pthread_mutex_t lock;
+    long* items;
+    long  head;
+    long  tail;
+    long  cap;
+} __attribute__((aligned(64))) task_deque;
+
 num_task** tasks;
 long data_top = 0;
+int threads_n = DEFAULT_THREADS;
+task_deque deques[MAX_THREADS];
+long remaining = 0;
 
 long
 collatz_step(long n)
@@ -58,56 +77,112 @@ iterate(cell* xs)
     return xs;
 }
 
+void
+deque_push(task_deque* dq, long ii)
+{
+    pthread_mutex_lock(&(dq->lock));
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            for (long jj = dq->head; jj < dq->tail; ++jj) {
+                dq->items[jj - dq->head] = dq->items[jj];
+            }
+            dq->tail -= dq->head;
+            dq->head = 0;
+        }
+        else {
+            dq->cap *= 2;
+            dq->items = xrealloc(dq->items, dq->cap * sizeof(long));
+        }
+    }
+    dq->items[dq->tail++] = ii;
+    pthread_mutex_unlock(&(dq->lock));
+}
+
 int
-scan_and_iterate()
+deque_pop(task_deque* dq, long* ii)
 {
-    long done_count = 0;
-    long base = random() % data_top;
+    int found = 0;
+    pthread_mutex_lock(&(dq->lock));
+    if (dq->tail > dq->head) {
+        *ii = dq->items[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&(dq->lock));
+    return found;
+}
 
-    for (long i0 = 1; i0 < data_top; ++i0) {
-        long ii = 1 + (base + i0) % (data_top - 1);
+// Moves half of some other thread's tasks to our deque.
+int
+steal(int id)
+{
+    for (int kk = 1; kk < threads_n; ++kk) {
+        task_deque* victim = &(deques[(id + kk) % threads_n]);
+        long got[64];
+        long count = 0;
 
-        pthread_mutex_lock(&(tasks[ii]->lock));
-        int skip = tasks[ii]->dibs;
-        if (!skip) {
-            tasks[ii]->dibs = 1;
+        pthread_mutex_lock(&(victim->lock));
+        long avail = victim->tail - victim->head;
+        count = (avail + 1) / 2;
+        if (count > 64) {
+            count = 64;
         }
-        pthread_mutex_unlock(&(tasks[ii]->lock));
-        if (skip) {
-            continue;
+        for (long jj = 0; jj < count; ++jj) {
+            got[jj] = victim->items[victim->head++];
         }
+        pthread_mutex_unlock(&(victim->lock));
 
-        cell* xs = tasks[ii]->vals;
-        long vv = xs->item;
-
-        if (vv > 1) {
-            xs = copy_list(xs);
-            xs = iterate(xs);
-            free_list(tasks[ii]->vals);
-            tasks[ii]->vals = xs;
+        for (long jj = 0; jj < count; ++jj) {
+            deque_push(&(deques[id]), got[jj]);
         }
-        else {
-            if (tasks[ii]->steps == -1) {
-                tasks[ii]->steps = count_list(tasks[ii]->vals) - 1;
-            }
-
-            done_count += 1;
+        if (count > 0) {
+            return 1;
         }
+    }
+    return 0;
+}
+
+// Advances task ii by up to 50 steps. Returns 1 once it has reached 1.
+int
+run_task(long ii)
+{
+    cell* xs = tasks[ii]->vals;
+    long vv = xs->item;
+
+    if (vv > 1) {
+        xs = copy_list(xs);
+        xs = iterate(xs);
+        free_list(tasks[ii]->vals);
+        tasks[ii]->vals = xs;
+        vv = xs->item;
+    }
 
-        pthread_mutex_lock(&(tasks[ii]->lock));
-        tasks[ii]->dibs = 0;
-        pthread_mutex_unlock(&(tasks[ii]->lock));
+    if (vv > 1) {
+        return 0;
     }
 
-    return done_count == (data_top - 1);
+    tasks[ii]->steps = count_list(tasks[ii]->vals) - 1;
+    return 1;
 }
 
 void*
-worker(void* _arg)
+worker(void* arg)
 {
-    int done = 0;
-    while (!done) {
-        done = scan_and_iterate();
+    int id = (int)(long)arg;
+    while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) > 0) {
+        long ii;
+        if (!deque_pop(&(deques[id]), &ii)) {
+            if (!steal(id)) {
+                sched_yield();
+            }
+            continue;
+        }
+
+        if (run_task(ii)) {
+            __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+        }
+        else {
+            deque_push(&(deques[id]), ii);
+        }
     }
     return 0;
 }
@@ -115,32 +190,51 @@ worker(void* _arg)
 int
 main(int argc, char* argv[])
 {
-    pthread_t threads[THREADS];
+    pthread_t threads[MAX_THREADS];
     int rv;
 
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         printf("Usage:\n");
-        printf("\t%s TOP\n", argv[0]);
+        printf("\t%s TOP [THREADS]\n", argv[0]);
         return 1;
     }
 
     data_top  = atol(argv[1]);
+    if (argc == 3) {
+        threads_n = atoi(argv[2]);
+    }
+    if (threads_n < 1 || threads_n > MAX_THREADS) {
+        printf("THREADS must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
 
     tasks = xmalloc(data_top * sizeof(num_task*));
+    size_t got = xmalloc_bulk(sizeof(num_task), data_top, (void**)tasks);
+    assert(got == (size_t)data_top);
     for (int ii = 0; ii < data_top; ++ii) {
-        tasks[ii] = xmalloc(sizeof(num_task));
         tasks[ii]->vals  = cons(ii, 0);
         tasks[ii]->steps = -1;
-        tasks[ii]->dibs  = 0;
-        pthread_mutex_init(&(tasks[ii]->lock), 0);
     }
 
-    for (int ii = 0; ii < THREADS; ++ii) {
-        rv = pthread_create(&(threads[ii]), 0, worker, 0);
+    // Deal the tasks out in contiguous blocks.
+    for (int ii = 0; ii < threads_n; ++ii) {
+        pthread_mutex_init(&(deques[ii].lock), 0);
+        deques[ii].cap   = data_top / threads_n + 16;
+        deques[ii].items = xmalloc(deques[ii].cap * sizeof(long));
+        deques[ii].head  = 0;
+        deques[ii].tail  = 0;
+    }
+    for (long ii = 1; ii < data_top; ++ii) {
+        deque_push(&(deques[(ii - 1) * threads_n / (data_top - 1)]), ii);
+    }
+    remaining = data_top > 1 ? data_top - 1 : 0;
+
+    for (int ii = 0; ii < threads_n; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, (void*)(long)ii);
         assert(rv == 0);
     }
 
-    for (int ii = 0; ii < THREADS; ++ii) {
+    for (int ii = 0; ii < threads_n; ++ii) {
         rv = pthread_join(threads[ii], 0);
         assert(rv == 0);
     }
@@ -159,10 +253,13 @@ main(int argc, char* argv[])
 
     for (int ii = 0; ii < data_top; ++ii) {
         free_list(tasks[ii]->vals);
-        xfree(tasks[ii]);
     }
+    xfree_bulk((void**)tasks, data_top);
     xfree(tasks);
 
+    for (int ii = 0; ii < threads_n; ++ii) {
+        xfree(deques[ii].items);
+    }
+
     return 0;
 }
-
@@ -5,6 +5,7 @@
 //
 // Once you've read this, you're done with the simple allocator homework.
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <sys/mman.h>
 #include <assert.h>
@@ -12,6 +13,17 @@
 #include <pthread.h>
 #include <string.h>
 #include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <execinfo.h>
 
 #include "omem.h"
 
@@ -34,210 +46,3487 @@ typedef struct nu_free_cell
 
 typedef struct nu_bin
 {
-    int64_t size;
     struct nu_free_cell* node;
 } nu_bin;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
 #define BIN_LENGTH 64
-static nu_bin bins[BIN_LENGTH];
-static int bin_init = 0;
 
-static const int64_t CHUNK_SIZE = 4096;
-static const int64_t CELL_SIZE = (int64_t)sizeof(nu_free_cell);
+// Small requests are served from slab chunks: every object in a slab
+// chunk has the same size class and carries no header of its own, and
+// free objects are linked through their first word. Objects are
+// naturally aligned, to the largest power of two dividing their size,
+// so a 64-byte object is 64-byte aligned and a 192-byte one 64-byte
+// aligned.
+//
+// The classes, the size-to-class lookup and the layout of each class's
+// chunks come from size_classes.h, which gen_classes writes for the
+// scheme picked with make CLASSES=...
+#include "size_classes.h"
+
+struct nu_chunk;
+
+// Chunks are carved out of large regions reserved with one mmap each.
+// The first chunk of a region holds this header and a bitmap of the
+// chunks whose pages have been handed back to the kernel with madvise,
+// so they can be found and reused later. Each arena grows its own
+// regions geometrically from REGION_MIN to REGION_MAX.
+#define REGION_MIN (1L << 20)
+#define REGION_MAX (64L << 20)
+
+// With OMEM_THP set, regions are 2 MiB aligned and backed by huge pages,
+// either transparent ones requested with MADV_HUGEPAGE or, for
+// OMEM_THP=hugetlb, reserved ones from MAP_HUGETLB while the kernel has
+// any to give.
+#define HUGE_PAGE (2L << 20)
+#define HUGE_OFF 0
+#define HUGE_THP 1
+#define HUGE_TLB 2
+static int huge_mode = HUGE_OFF;
+
+typedef struct nu_region
+{
+    struct nu_region *next;    // all regions, newest first
+    struct nu_region *anext;   // this arena's regions
+    int64_t size;
+    int64_t bump;              // offset of the next never-used chunk
+    long released;             // chunks set in the bitmap
+    uint64_t bitmap[];
+} nu_region;
+
+// An arena is an independent heap: its own bins[], slab lists and lock,
+// plus a lock-free list of objects that other arenas' threads freed into
+// it. Threads are bound to one arena of the NUMA node they first
+// allocate on for life; the remote list is drained by whichever of its
+// threads next takes the lock.
+typedef struct nu_arena
+{
+    pthread_mutex_t lock;
+    nu_bin bins[BIN_LENGTH];
+    uint64_t nonempty; // bit i set when bins[i] has cells
+    struct nu_chunk *slabs[SLAB_CLASSES];
+    struct nu_chunk *empty;      // fully free chunks, most recent first
+    struct nu_chunk *empty_tail;
+    long empty_count;
+    nu_region *regions;
+    nu_region *region;           // region chunks are being carved from
+    int64_t region_size;         // size of the next region to reserve
+    long released;               // released chunks over all regions
+    void *remote;
+    int index;
+    int node;                    // NUMA node this arena's memory lives on
+    uint64_t batches[SLAB_CLASSES]; // tagged tops of the batch stacks
+    int batch_depth[SLAB_CLASSES];
+} nu_arena;
+
+enum
+{
+    CHUNK_BLOCK, // variable-sized cells with size headers, kept in bins[]
+    CHUNK_SLAB,  // one size class, headerless objects
+    CHUNK_LARGE, // a single mmap'd allocation
+    CHUNK_EMPTY, // nothing allocated, waiting for reuse or release
+};
+
+// Every chunk starts with this descriptor, so the chunk behind any
+// pointer handed out by omalloc can be found by masking its address.
+// Slab chunks with free objects sit on their arena's slabs[] list, and
+// chunks with nothing allocated in them on its empty list.
+typedef struct nu_chunk
+{
+    nu_arena *arena;
+    int64_t size;   // slab: object size; large: bytes mapped
+    void *free;     // slab: objects freed back to this chunk
+    char *fresh;    // slab: next object never handed out
+    struct nu_chunk *next;
+    struct nu_chunk *prev;
+    int16_t used;   // slab: objects currently handed out; large: 1 while
+                    // the mapping is still untouched zero pages
+    int8_t zeroed;  // slab, block: nothing freed since the chunk came
+                    // zeroed from the kernel
+    int8_t cls;
+    int8_t kind;
+    int8_t partial; // slab: on the arena's slabs[] list
+    int8_t sampled; // may hold objects sampled by the heap profiler
+    int64_t stamp;  // empty, cached: when the chunk was freed, in ms;
+                    // large: bytes asked for
+    nu_region *region;
+    int64_t offset; // large: distance from the chunk to the user pointer
+} __attribute__((aligned(16))) nu_chunk;
+
+// gen_classes lays out slab chunks for a descriptor of this size.
+_Static_assert(sizeof(nu_chunk) == SLAB_CHUNK_HEADER, "size_classes.h is out of date");
+_Static_assert(SLAB_CLASSES + 2 <= OM_MAX_CLASSES, "too many slab classes");
+
+#define MAX_ARENAS OM_MAX_ARENAS
+
+// Per-thread cache of free slab objects, one list per size class,
+// sitting in front of the arena. Objects are linked through their first
+// word. Every cached object belongs to tcache.arena.
+#define TCACHE_BATCH 32
+#define TCACHE_HIGH 128
+
+// Between the thread caches and the slabs, each arena keeps a lock-free
+// stack per class of full TCACHE_BATCH batches, so threads sharing an
+// arena hand batches to each other with one CAS instead of the arena
+// lock. Objects in a batch are linked through their first word and the
+// batches through the second word of their first object. The top is a
+// pointer with a 16-bit tag in its high bits, bumped on every push and
+// pop, so a pop cannot succeed against a top that was popped and pushed
+// back in between (ABA). Batched objects still count as used in their
+// slab, so their chunks stay mapped while a stale reader looks at them.
+#define BATCH_STACK_MAX 8
+#define TAG_SHIFT 48
+#define TAG_PTR(top) ((void *)(uintptr_t)((top) & ((1ULL << TAG_SHIFT) - 1)))
+
+typedef struct nu_tcache_bin
+{
+    void *head;
+    int count;
+} nu_tcache_bin;
+
+// Counters are kept per thread, next to the thread cache, so the hot
+// path never writes to a shared cache line. ogetstats() adds up the live
+// threads and the totals left behind by threads that have exited.
+#define STAT_CLASSES (SLAB_CLASSES + 2)
+#define STAT_BLOCK SLAB_CLASSES
+#define STAT_LARGE (SLAB_CLASSES + 1)
+
+typedef struct nu_stats
+{
+    long allocs[STAT_CLASSES];
+    long frees[STAT_CLASSES];
+    long bytes_allocated;
+    long bytes_freed;
+    long lock_acquired;
+    long lock_contended;
+    long tcache_hits;
+    long tcache_misses;
+    long batch_hits;   // tcache misses served from a batch stack
+    long large_hits;
+    long large_misses;
+} nu_stats;
+
+typedef struct nu_tcache
+{
+    nu_tcache_bin bins[SLAB_CLASSES];
+    nu_arena *arena;
+    int registered;
+    struct nu_tcache *next; // live threads, for ogetstats()
+    struct nu_tcache *prev;
+    nu_stats stats;
+    int64_t prof_left;  // bytes to allocate before the next sample
+    uint64_t prof_seed;
+    int prof_busy;
+} __attribute__((aligned(64))) nu_tcache;
+
+// Initialisation may itself allocate (pthread_atfork, atexit), and when
+// omem stands in for malloc those calls land back here. The initialising
+// thread is let through once the tables are set up, instead of
+// deadlocking on init_once.
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int nu_ready = 0;
+static pthread_key_t tcache_key;
+static int tcache_key_ready = 0;
+static __thread nu_tcache tcache __attribute__((tls_model("initial-exec")));
+static __thread int nu_initializing __attribute__((tls_model("initial-exec")));
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static nu_tcache *live_threads = NULL;
+static nu_stats dead_threads;
+
+static nu_arena arenas[MAX_ARENAS];
+static int arena_count = 1;
+static int arena_by_cpu = 0;
+
+// NUMA placement: arena i serves node i % node_count and its regions are
+// bound to that node with mbind(MPOL_PREFERRED). node_real is what the
+// kernel reports; OMEM_NODES may claim more for testing, in which case
+// threads are dealt out over the nodes in turn and nothing is bound.
+#define MAX_NODES OM_MAX_NODES
+#define NU_MPOL_PREFERRED 1
+static int node_count = 1;
+static int node_real = 1;
+static int node_next[MAX_NODES];
+static int node_fake_next = 0;
+static long node_pages[MAX_NODES];        // region pages held for the node
+static long node_remote_frees[MAX_NODES]; // frees into it from other nodes
+
+// Block chunks hold cells whose sizes are multiples of 16. The first
+// cell starts 8 bytes past the descriptor so that the pointer after each
+// 8-byte header is 16-byte aligned. Free cells have a plain size in the
+// header and a footer; allocated cells have CELL_USED in the header, plus
+// CELL_PREV_FREE when the cell before them is free and its footer valid.
+// No two free cells are ever adjacent.
+static const int64_t CHUNK_SIZE = SLAB_CHUNK_SIZE;
 
-static nu_free_cell *nu_free_list = 0;
+// Largest request taken. Sizes are handled as int64_t, and a large
+// mapping adds its descriptor and alignment and rounds up by as much as
+// a quarter, which must not overflow; no address space comes near this.
+#define NU_SIZE_MAX ((size_t)PTRDIFF_MAX / 4)
+static const int64_t BLOCK_START = sizeof(nu_chunk) + 8;
+static const int64_t BLOCK_MAX = (4096 - sizeof(nu_chunk) - 8) & ~15;
+#define CELL_USED 1
+#define CELL_PREV_FREE 2
+#define CELL_FLAGS 3
+static const int64_t CELL_SIZE = (int64_t)sizeof(nu_free_cell);
 
 static long nu_malloc_chunks = 0;
 static long nu_free_chunks = 0;
+static long nu_pages_mapped = 0;
+static long nu_pages_unmapped = 0;
+static long nu_mmap_calls = 0;
+
+static nu_region *all_regions = NULL;
+
+// Freed large mappings are kept for reuse in buckets of similar size,
+// newest first, up to large_cache_budget bytes in total. Entries idle for
+// longer than chunk_decay_ms are unmapped on the next large operation.
+#define LARGE_BUCKETS 112
+
+typedef struct nu_large_bucket
+{
+    struct nu_chunk *head;
+    struct nu_chunk *tail;
+} nu_large_bucket;
+
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static nu_large_bucket large_cache[LARGE_BUCKETS];
+static struct nu_chunk *large_live = NULL; // allocated, for oheap_walk()
+static int64_t large_cache_bytes = 0;
+static int64_t large_cache_budget = 32L << 20;
+
+// Each arena keeps up to chunk_retain empty chunks for reuse and hands
+// anything beyond that back to the kernel at once. Empty chunks older
+// than chunk_decay_ms are released the next time the arena takes its
+// slow path.
+static long chunk_retain = 16;
+static long chunk_decay_ms = 1000;
+
+// Bin holding free cells of the given size: bins 0..31 are 8 bytes
+// apart starting at 16 (bin 31 also takes everything below 512), bins
+// 32..63 are powers of two starting at 512.
+static int
+nu_bin_index(int64_t size)
+{
+    if (size < 512)
+    {
+        int i = (int)((size - 16) >> 3);
+        return i < BIN_LENGTH / 2 ? i : BIN_LENGTH / 2 - 1;
+    }
+    int i = BIN_LENGTH / 2 + (63 - __builtin_clzll(size)) - 9;
+    return i < BIN_LENGTH ? i : BIN_LENGTH - 1;
+}
 
-void init_bins() {
-    int64_t s = 16;
-    for (int i = 0; i < BIN_LENGTH / 2; i++) {
-        bins[i].size = s;
-        bins[i].node = NULL;
-        s += 8;
+// First bin whose every cell is at least size bytes.
+static int
+nu_bin_fit(int64_t size)
+{
+    if (size <= 16)
+    {
+        return 0;
+    }
+    if (size <= 264)
+    {
+        return (int)((size - 16 + 7) >> 3);
     }
-    for (int i = BIN_LENGTH / 2; i < BIN_LENGTH; i++) {
-        bins[i].size = 1 << (i+9); // starting from 512 = 2^9
-        bins[i].node = NULL;
+    if (size <= 512)
+    {
+        return BIN_LENGTH / 2;
+    }
+    return BIN_LENGTH / 2 + (64 - __builtin_clzll(size - 1)) - 9;
+}
+
+static void
+nu_free_list_insert(nu_arena *arena, nu_free_cell *cell)
+{
+    nu_footer* footer = (void *)cell + cell->size - sizeof(nu_footer);
+    footer->size = cell->size;
+
+    int i = nu_bin_index(cell->size);
+    nu_bin *bin = &arena->bins[i];
+    nu_free_cell *temp = bin->node;
+    bin->node = cell;
+    cell->next = temp;
+    cell->prev = NULL;
+    if (temp != NULL) {
+        temp->prev = cell;
     }
-    bin_init = 1;
+    arena->nonempty |= 1ULL << i;
 }
 
-int64_t
-nu_free_list_length()
+static nu_free_cell *
+free_list_get_cell(nu_arena *arena, int64_t size)
 {
-    int len = 0;
+    int start = nu_bin_fit(size);
+    if (start >= BIN_LENGTH)
+    {
+        return NULL;
+    }
 
-    for (nu_free_cell *pp = nu_free_list; pp != 0; pp = pp->next)
+    uint64_t avail = arena->nonempty & (~0ULL << start);
+    if (avail == 0)
     {
-        len++;
+        return NULL;
     }
 
-    return len;
+    int i = __builtin_ctzll(avail);
+    nu_bin *bin = &arena->bins[i];
+    nu_free_cell *temp = bin->node;
+    bin->node = temp->next;
+    if (bin->node == NULL)
+    {
+        arena->nonempty &= ~(1ULL << i);
+    }
+    else
+    {
+        bin->node->prev = NULL;
+    }
+    return temp;
+}
+
+// Unlinks a free cell from the middle of its bin.
+static void
+nu_free_list_remove(nu_arena *arena, nu_free_cell *cell)
+{
+    int i = nu_bin_index(cell->size);
+    if (cell->prev != NULL)
+    {
+        cell->prev->next = cell->next;
+    }
+    else
+    {
+        arena->bins[i].node = cell->next;
+        if (cell->next == NULL)
+        {
+            arena->nonempty &= ~(1ULL << i);
+        }
+    }
+    if (cell->next != NULL)
+    {
+        cell->next->prev = cell->prev;
+    }
 }
 
-void nu_print_free_list()
+static int64_t
+nu_now_ms()
 {
-    nu_free_cell *pp = nu_free_list;
-    printf("= Free list: =\n");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    for (; pp != 0; pp = pp->next)
+static void
+nu_empty_unlink(nu_arena *arena, nu_chunk *chunk)
+{
+    if (chunk->prev != NULL)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
     {
-        printf("%lx: (cell %ld %lx)\n", (int64_t)pp, pp->size, (int64_t)pp->next);
+        arena->empty = chunk->next;
     }
+    if (chunk->next != NULL)
+    {
+        chunk->next->prev = chunk->prev;
+    }
+    else
+    {
+        arena->empty_tail = chunk->prev;
+    }
+    arena->empty_count -= 1;
 }
 
+// Hands a chunk's pages back to the kernel and marks it in its region's
+// bitmap. The address range stays reserved for reuse.
 static void
-nu_free_list_coalesce()
+nu_chunk_release(nu_arena *arena, nu_chunk *chunk)
+{
+    nu_region *region = chunk->region;
+    int64_t i = ((void *)chunk - (void *)region) / CHUNK_SIZE;
+
+    nu_empty_unlink(arena, chunk);
+    madvise((void *)chunk, CHUNK_SIZE, MADV_DONTNEED);
+    region->bitmap[i / 64] |= 1ULL << (i % 64);
+    region->released += 1;
+    arena->released += 1;
+    __atomic_fetch_add(&nu_pages_unmapped, CHUNK_SIZE / 4096, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&node_pages[arena->node], CHUNK_SIZE / 4096, __ATOMIC_RELAXED);
+}
+
+// Takes a previously released chunk back out of the arena's regions.
+// Caller holds the arena lock and has checked arena->released.
+static nu_chunk *
+nu_chunk_reclaim(nu_arena *arena)
+{
+    for (nu_region *region = arena->regions; region != NULL; region = region->anext)
+    {
+        if (region->released == 0)
+        {
+            continue;
+        }
+        for (int64_t w = 0;; w++)
+        {
+            if (region->bitmap[w] != 0)
+            {
+                int64_t i = w * 64 + __builtin_ctzll(region->bitmap[w]);
+                region->bitmap[w] &= region->bitmap[w] - 1;
+                region->released -= 1;
+                arena->released -= 1;
+                nu_chunk *chunk = (nu_chunk *)((void *)region + i * CHUNK_SIZE);
+                chunk->region = region;
+                __atomic_fetch_add(&nu_pages_mapped, CHUNK_SIZE / 4096, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&node_pages[arena->node], CHUNK_SIZE / 4096, __ATOMIC_RELAXED);
+                return chunk;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Number of NUMA nodes the kernel knows of, from the last number in
+// /sys/devices/system/node/possible ("0" or "0-3"). Read with plain
+// open/read, since stdio would allocate. 1 if it cannot be read.
+static int
+nu_node_count()
 {
-    nu_free_cell *pp = nu_free_list;
-    int free_chunk = 0;
+    char buf[64];
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return 1;
+    }
+    buf[len] = 0;
 
-    while (pp != 0 && pp->next != 0)
+    int last = 0;
+    for (char *cc = buf; *cc != 0; cc++)
     {
-        if (((int64_t)pp) + pp->size == ((int64_t)pp->next))
+        if (*cc >= '0' && *cc <= '9')
         {
-            pp->size += pp->next->size;
-            pp->next = pp->next->next;
+            int n = 0;
+            while (*cc >= '0' && *cc <= '9')
+            {
+                n = n * 10 + (*cc++ - '0');
+            }
+            last = n;
+            cc--;
         }
+    }
+    return last + 1;
+}
 
-        pp = pp->next;
+// The node the calling thread runs on, or with made-up nodes the next
+// one in turn.
+static int
+nu_current_node(int *cpu_out)
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    {
+        cpu = 0;
+        node = 0;
+    }
+    if (cpu_out != NULL)
+    {
+        *cpu_out = (int)cpu;
+    }
+    if (node_count > node_real)
+    {
+        return __atomic_fetch_add(&node_fake_next, 1, __ATOMIC_RELAXED) % node_count;
     }
+    return (int)(node % node_count);
 }
 
+// Asks the kernel to place the pages of [addr, addr + size) on node,
+// falling back to other nodes when it is full. Only done on real NUMA
+// hosts; failure just leaves the default policy in place.
 static void
-nu_free_list_insert(nu_free_cell *cell)
+nu_node_bind(void *addr, int64_t size, int node)
 {
-    // printf("%s size: %ld\n", "cell", cell->size);
-    nu_footer* footer = (void *)cell + cell->size - sizeof(nu_footer);
-    footer->size = cell->size;
-    for (int i = 0; i < BIN_LENGTH - 1; i++) {
-        if (bins[i].size <= cell->size && bins[i+1].size > cell->size) {
-            nu_free_cell *temp = bins[i].node;
-            bins[i].node = cell;
-            cell->next = temp;
-            cell->prev = NULL;
-            if (temp != NULL) {
-                temp->prev = cell;
-            }
-            return;
+    if (node_real > 1 && node < node_real)
+    {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, addr, size, NU_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+}
+
+// Maps size bytes for a region, on huge pages if huge_mode asks for
+// them. Returns MAP_FAILED on failure.
+static void *
+nu_region_map(int64_t size)
+{
+    int mode = __atomic_load_n(&huge_mode, __ATOMIC_RELAXED);
+    if (mode == HUGE_TLB)
+    {
+        void *addr = mmap(0, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED)
+        {
+            return addr;
         }
+        // The reserved pool is empty or absent: use transparent huge
+        // pages from now on.
+        __atomic_store_n(&huge_mode, HUGE_THP, __ATOMIC_RELAXED);
+        mode = HUGE_THP;
     }
-    // big ones go to bins[last]
-    nu_free_cell *temp = bins[BIN_LENGTH - 1].node;
-    bins[BIN_LENGTH - 1].node = cell;
-    cell->next = temp;
-    cell->prev = NULL;
-    if (temp != NULL) {
-        temp->prev = cell;
+    if (mode == HUGE_OFF)
+    {
+        return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    // Over-map by a huge page and trim to a 2 MiB boundary.
+    void *addr = mmap(0, size + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return addr;
     }
-    return;
+    void *start = (void *)(((uintptr_t)addr + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (start > addr)
+    {
+        munmap(addr, start - addr);
+    }
+    munmap(start + size, (addr + size + HUGE_PAGE) - (start + size));
+    madvise(start, size, MADV_HUGEPAGE);
+    return start;
 }
 
-static nu_free_cell *
-free_list_get_cell(int64_t size)
+// Reserves a new region for the arena, twice the size of the last one
+// up to REGION_MAX, or returns NULL if it cannot be mapped. Caller holds
+// the arena lock.
+static nu_region *
+nu_region_new(nu_arena *arena)
+{
+    int64_t size = arena->region_size;
+    int64_t min = huge_mode != HUGE_OFF ? HUGE_PAGE : REGION_MIN;
+    if (size < min)
+    {
+        size = min;
+    }
+    arena->region_size = size < REGION_MAX ? size * 2 : REGION_MAX;
+
+    void *addr = nu_region_map(size);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+    nu_node_bind(addr, size, arena->node);
+    __atomic_fetch_add(&node_pages[arena->node], size / 4096, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nu_mmap_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nu_pages_mapped, size / 4096, __ATOMIC_RELAXED);
+
+    nu_region *region = (nu_region *)addr;
+    region->size = size;
+    region->bump = CHUNK_SIZE;
+    region->released = 0;
+    region->anext = arena->regions;
+    arena->regions = region;
+    arena->region = region;
+
+    region->next = __atomic_load_n(&all_regions, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&all_regions, &region->next, region, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return region;
+}
+
+// Releases the arena's empty chunks that have sat unused for longer than
+// chunk_decay_ms. Caller holds the arena lock.
+static void
+nu_arena_decay(nu_arena *arena)
+{
+    if (arena->empty_tail == NULL || chunk_decay_ms < 0)
+    {
+        return;
+    }
+
+    int64_t cutoff = nu_now_ms() - chunk_decay_ms;
+    while (arena->empty_tail != NULL && arena->empty_tail->stamp <= cutoff)
+    {
+        nu_chunk_release(arena, arena->empty_tail);
+    }
+}
+
+// Parks a chunk with nothing allocated in it on the arena's empty list,
+// releasing the oldest one if that takes the arena over chunk_retain.
+// Caller holds the arena lock.
+static void
+nu_chunk_retire(nu_arena *arena, nu_chunk *chunk)
+{
+    chunk->kind = CHUNK_EMPTY;
+    chunk->stamp = nu_now_ms();
+    chunk->prev = NULL;
+    chunk->next = arena->empty;
+    if (chunk->next != NULL)
+    {
+        chunk->next->prev = chunk;
+    }
+    else
+    {
+        arena->empty_tail = chunk;
+    }
+    arena->empty = chunk;
+    arena->empty_count += 1;
+
+    if (arena->empty_count > chunk_retain)
+    {
+        nu_chunk_release(arena, arena->empty_tail);
+    }
+}
+
+// Takes an empty chunk for the arena, or NULL when no region can be
+// mapped. Caller holds the arena lock.
+static nu_chunk *
+make_chunk(nu_arena *arena, int kind)
 {
-    for (int i = 0; i < BIN_LENGTH; i++) {
-        if (bins[i].node != NULL && bins[i].size >= size) {
-            nu_free_cell *temp = bins[i].node;
-            bins[i].node = bins[i].node->next;
-            return temp;
+    nu_chunk *chunk = arena->empty;
+    if (chunk != NULL)
+    {
+        nu_empty_unlink(arena, chunk);
+        chunk->zeroed = 0;
+    }
+    else if (arena->released > 0)
+    {
+        chunk = nu_chunk_reclaim(arena);
+        // A dropped page reads back as zeros, kind included; a chunk whose
+        // madvise failed still says CHUNK_EMPTY.
+        chunk->zeroed = chunk->kind != CHUNK_EMPTY;
+    }
+    else
+    {
+        nu_region *region = arena->region;
+        if (region == NULL || region->bump == region->size)
+        {
+            region = nu_region_new(arena);
+            if (region == NULL)
+            {
+                return NULL;
+            }
         }
+        chunk = (nu_chunk *)((void *)region + region->bump);
+        region->bump += CHUNK_SIZE;
+        chunk->region = region;
+        chunk->zeroed = 1;
+    }
+    chunk->arena = arena;
+    chunk->kind = kind;
+    chunk->sampled = 0;
+    return chunk;
+}
+
+// Called on every free and on every cell handed back to the bins: the
+// chunk may now hold bytes someone wrote.
+static inline void
+nu_chunk_dirty(nu_chunk *chunk)
+{
+    if (__atomic_load_n(&chunk->zeroed, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&chunk->zeroed, 0, __ATOMIC_RELAXED);
     }
-    return NULL;
 }
 
 static nu_free_cell *
-make_cell()
+make_cell(nu_arena *arena)
 {
-    void *addr = mmap(0, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    nu_free_cell *cell = (nu_free_cell *)addr;
-    cell->size = CHUNK_SIZE;
+    nu_chunk *chunk = make_chunk(arena, CHUNK_BLOCK);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    nu_free_cell *cell = (nu_free_cell *)((void *)chunk + BLOCK_START);
+    cell->size = BLOCK_MAX;
     return cell;
 }
 
-void *
-omalloc(size_t usize)
+// Takes the arena lock, counting the times it was already held.
+static void
+nu_lock(nu_arena *arena)
 {
-    if (!bin_init) {
-        init_bins();
+    if (pthread_mutex_trylock(&arena->lock) != 0)
+    {
+        tcache.stats.lock_contended += 1;
+        pthread_mutex_lock(&arena->lock);
     }
-    pthread_mutex_lock(&lock);
-    int64_t size = (int64_t)usize;
+    tcache.stats.lock_acquired += 1;
+}
 
-    // space for size
-    int64_t alloc_size = size + (sizeof(int64_t));
+// The chunk descriptor for a pointer handed out by omalloc. Pointers are
+// never at offset 0 of their chunk, but a page-aligned large pointer sits
+// right at the start of the page after its descriptor, hence the - 1.
+static nu_chunk *
+ptr_chunk(void *ptr)
+{
+    return (nu_chunk *)(((uintptr_t)ptr - 1) & ~(uintptr_t)(CHUNK_SIZE - 1));
+}
 
-    // space for free cell when returned to list
-    if (alloc_size < CELL_SIZE)
+static void
+nu_slab_link(nu_arena *arena, nu_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = arena->slabs[chunk->cls];
+    if (chunk->next != NULL)
     {
-        alloc_size = CELL_SIZE;
+        chunk->next->prev = chunk;
     }
+    arena->slabs[chunk->cls] = chunk;
+    chunk->partial = 1;
+}
 
-    // TODO: Handle large allocations.
-    if (alloc_size > CHUNK_SIZE)
+static void
+nu_slab_unlink(nu_arena *arena, nu_chunk *chunk)
+{
+    if (chunk->prev != NULL)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
+    {
+        arena->slabs[chunk->cls] = chunk->next;
+    }
+    if (chunk->next != NULL)
     {
-        void *addr = mmap(0, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        *((int64_t *)addr) = alloc_size;
-        nu_malloc_chunks += 1;
-        pthread_mutex_unlock(&lock);
-        return addr + sizeof(int64_t);
+        chunk->next->prev = chunk->prev;
     }
+    chunk->partial = 0;
+}
 
-    nu_free_cell *cell = free_list_get_cell(alloc_size);
-    if (cell == NULL)
+static nu_chunk *
+nu_slab_new(nu_arena *arena, int cls)
+{
+    nu_chunk *chunk = make_chunk(arena, CHUNK_SLAB);
+    if (chunk == NULL)
     {
-        cell = make_cell();
+        return NULL;
     }
+    chunk->cls = cls;
+    chunk->size = slab_sizes[cls];
+    chunk->free = NULL;
+    chunk->fresh = (char *)chunk + slab_start[cls];
+    chunk->used = 0;
+    nu_slab_link(arena, chunk);
+    return chunk;
+}
 
-    // Return unused portion to free list.
-    int64_t rest_size = cell->size - alloc_size;
-    if (rest_size >= CELL_SIZE)
+// Pops count objects of class cls off the arena's slab chunks onto the
+// list at *head, opening new slab chunks as needed. Returns how many it
+// took, fewer than count only when memory runs out. Caller holds the
+// arena lock.
+static int
+nu_slab_take(nu_arena *arena, int cls, void **head, int count)
+{
+    for (int i = 0; i < count; i++)
     {
-        void *addr = (void *)cell;
-        nu_free_cell *rest = (nu_free_cell *)(addr + alloc_size);
-        rest->size = rest_size;
-        nu_free_list_insert(rest);
+        nu_chunk *chunk = arena->slabs[cls];
+        if (chunk == NULL)
+        {
+            chunk = nu_slab_new(arena, cls);
+            if (chunk == NULL)
+            {
+                return i;
+            }
+        }
+
+        void *obj;
+        if (chunk->free != NULL)
+        {
+            obj = chunk->free;
+            chunk->free = *(void **)obj;
+        }
+        else
+        {
+            obj = chunk->fresh;
+            chunk->fresh += chunk->size;
+        }
+        chunk->used += 1;
+
+        if (chunk->free == NULL && chunk->fresh + chunk->size > (char *)chunk + CHUNK_SIZE)
+        {
+            nu_slab_unlink(arena, chunk);
+        }
+
+        *(void **)obj = *head;
+        *head = obj;
     }
+    return count;
+}
 
-    *((int64_t *)cell) = alloc_size;
-    nu_footer* footer = (void *)cell + alloc_size - sizeof(nu_footer);
-    footer->size = alloc_size;
-    pthread_mutex_unlock(&lock);
-    return ((void *)cell) + sizeof(nu_header);
+// Returns one object to its slab chunk. Caller holds the arena lock.
+static void
+nu_slab_put(nu_arena *arena, void *obj)
+{
+    nu_chunk *chunk = ptr_chunk(obj);
+    *(void **)obj = chunk->free;
+    chunk->free = obj;
+    chunk->used -= 1;
+    if (chunk->used == 0)
+    {
+        if (chunk->partial)
+        {
+            nu_slab_unlink(arena, chunk);
+        }
+        nu_chunk_retire(arena, chunk);
+    }
+    else if (!chunk->partial)
+    {
+        nu_slab_link(arena, chunk);
+    }
 }
 
-void ofree(void *addr)
+// Hands a freed block cell back to the arena's bins, first merging it
+// with whichever of its neighbours in the chunk are free. Caller holds
+// the arena lock.
+static void
+nu_block_put(nu_arena *arena, void *ptr)
 {
-    pthread_mutex_lock(&lock);
-    nu_free_cell *cell = (nu_free_cell *)(addr - sizeof(int64_t));
-    int64_t size = *((int64_t *)cell);
-    cell->size = size;
-    cell->prev = NULL;
-    cell->next = NULL;
+    nu_free_cell *cell = (nu_free_cell *)(ptr - sizeof(nu_header));
+    int64_t flags = cell->size;
+    int64_t size = cell->size & ~CELL_FLAGS;
+    void *end = (void *)ptr_chunk(cell) + BLOCK_START + BLOCK_MAX;
 
-    if (size > CHUNK_SIZE)
+    nu_chunk_dirty(ptr_chunk(cell));
+
+    nu_free_cell *next = (void *)cell + size;
+    if ((void *)next < end && !(next->size & CELL_USED))
     {
-        nu_free_chunks += 1;
-        munmap((void *)cell, size);
+        nu_free_list_remove(arena, next);
+        size += next->size;
     }
-    else
+
+    if (flags & CELL_PREV_FREE)
+    {
+        nu_footer *footer = (void *)cell - sizeof(nu_footer);
+        nu_free_cell *prev = (void *)cell - footer->size;
+        nu_free_list_remove(arena, prev);
+        size += footer->size;
+        cell = prev;
+    }
+
+    if (size == BLOCK_MAX)
+    {
+        nu_chunk_retire(arena, ptr_chunk(cell));
+        return;
+    }
+
+    cell->size = size;
+    nu_free_list_insert(arena, cell);
+
+    next = (void *)cell + size;
+    if ((void *)next < end)
     {
-        cell->size = size;
-        nu_free_list_insert(cell);
+        next->size |= CELL_PREV_FREE;
     }
-    pthread_mutex_unlock(&lock);
 }
 
-void *orealloc(void *prev, size_t bytes)
+// Pushes a freed object onto another arena's remote-free list. Any
+// number of threads may push concurrently; the owner takes the whole
+// list at once.
+static void
+nu_remote_push(nu_arena *arena, void *ptr)
+{
+    void *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Returns everything other arenas have freed into this one to its slabs
+// and bins. Caller holds arena->lock.
+static void
+nu_remote_drain(nu_arena *arena)
+{
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+
+    void *pp = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    while (pp != NULL)
+    {
+        void *next = *(void **)pp;
+        if (ptr_chunk(pp)->kind == CHUNK_SLAB)
+        {
+            nu_slab_put(arena, pp);
+        }
+        else
+        {
+            nu_block_put(arena, pp);
+        }
+        pp = next;
+    }
+}
+
+// Takes a cell of exactly alloc_size bytes out of the arena's bins,
+// splitting off and re-binning whatever is left over. Returns NULL when
+// memory runs out. Caller holds the arena lock.
+static nu_free_cell *
+nu_take_cell(nu_arena *arena, int64_t alloc_size)
+{
+    nu_free_cell *cell = free_list_get_cell(arena, alloc_size);
+    if (cell == NULL)
+    {
+        cell = make_cell(arena);
+        if (cell == NULL)
+        {
+            return NULL;
+        }
+    }
+    void *end = (void *)ptr_chunk(cell) + BLOCK_START + BLOCK_MAX;
+
+    // Return unused portion to free list.
+    int64_t rest_size = cell->size - alloc_size;
+    if (rest_size >= CELL_SIZE)
+    {
+        void *addr = (void *)cell;
+        nu_free_cell *rest = (nu_free_cell *)(addr + alloc_size);
+        rest->size = rest_size;
+        nu_free_list_insert(arena, rest);
+    }
+    else
+    {
+        alloc_size = cell->size;
+        nu_free_cell *next = (void *)cell + alloc_size;
+        if ((void *)next < end)
+        {
+            next->size &= ~CELL_PREV_FREE;
+        }
+    }
+
+    *((int64_t *)cell) = alloc_size | CELL_USED;
+    return cell;
+}
+
+// Slab size class for a request of at most SLAB_MAX bytes.
+static int
+nu_size_class(int64_t size)
+{
+    return slab_class_of[(size + 15) >> 4];
+}
+
+static uint64_t
+nu_batch_tag(void *ptr, uint64_t old)
+{
+    return (uintptr_t)ptr | (((old >> TAG_SHIFT) + 1) << TAG_SHIFT);
+}
+
+// Pushes the batch starting at head onto the arena's stack for cls.
+// Returns 0 without pushing if the stack is already BATCH_STACK_MAX deep.
+static int
+nu_batch_push(nu_arena *arena, int cls, void *head)
+{
+    if (__atomic_add_fetch(&arena->batch_depth[cls], 1, __ATOMIC_RELAXED) > BATCH_STACK_MAX)
+    {
+        __atomic_sub_fetch(&arena->batch_depth[cls], 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    uint64_t top = __atomic_load_n(&arena->batches[cls], __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&((void **)head)[1], TAG_PTR(top), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&arena->batches[cls], &top, nu_batch_tag(head, top), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// Pops a batch off the arena's stack for cls, or returns NULL.
+static void *
+nu_batch_pop(nu_arena *arena, int cls)
+{
+    uint64_t top = __atomic_load_n(&arena->batches[cls], __ATOMIC_ACQUIRE);
+    while (TAG_PTR(top) != NULL)
+    {
+        void *next = __atomic_load_n(&((void **)TAG_PTR(top))[1], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&arena->batches[cls], &top, nu_batch_tag(next, top), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            __atomic_sub_fetch(&arena->batch_depth[cls], 1, __ATOMIC_RELAXED);
+            return TAG_PTR(top);
+        }
+    }
+    return NULL;
+}
+
+// Moves up to count objects from the front of a thread cache list back
+// to the arena: a full batch onto its batch stack if there is room,
+// otherwise to their slab chunks under a single lock round-trip.
+static void
+tcache_flush(nu_tcache *tc, nu_tcache_bin *tb, int count)
+{
+    nu_arena *arena = tc->arena;
+
+    if (count == TCACHE_BATCH && tb->count > TCACHE_BATCH)
+    {
+        void *head = tb->head;
+        void *last = head;
+        for (int i = 1; i < TCACHE_BATCH; i++)
+        {
+            last = *(void **)last;
+        }
+        void *rest = *(void **)last;
+        *(void **)last = NULL;
+        if (nu_batch_push(arena, tb - tc->bins, head))
+        {
+            tb->head = rest;
+            tb->count -= TCACHE_BATCH;
+            return;
+        }
+        *(void **)last = rest;
+    }
+
+    nu_lock(arena);
+    while (tb->head != NULL && count > 0)
+    {
+        void *obj = tb->head;
+        tb->head = *(void **)obj;
+        tb->count -= 1;
+        count -= 1;
+        nu_slab_put(arena, obj);
+    }
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void
+nu_stats_add(nu_stats *into, nu_stats *from)
+{
+    long *dst = (long *)into;
+    long *src = (long *)from;
+    for (size_t i = 0; i < sizeof(nu_stats) / sizeof(long); i++)
+    {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// pthread key destructor: hands a dead thread's cached objects back to
+// its arena so other threads can use them, and folds its counters into
+// the totals.
+static void
+tcache_drain(void *arg)
+{
+    nu_tcache *tc = (nu_tcache *)arg;
+    // A thread that only used large mappings has no arena and no cache.
+    for (int i = 0; i < SLAB_CLASSES && tc->arena != NULL; i++)
+    {
+        tcache_flush(tc, &tc->bins[i], tc->bins[i].count);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    nu_stats_add(&dead_threads, &tc->stats);
+    memset(&tc->stats, 0, sizeof(nu_stats));
+    if (tc->prev != NULL)
+    {
+        tc->prev->next = tc->next;
+    }
+    else
+    {
+        live_threads = tc->next;
+    }
+    if (tc->next != NULL)
+    {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    tc->registered = 0;
+}
+
+static void
+tcache_register()
+{
+    if (!tcache.registered && tcache_key_ready)
+    {
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+
+        pthread_mutex_lock(&stats_lock);
+        tcache.prev = NULL;
+        tcache.next = live_threads;
+        if (live_threads != NULL)
+        {
+            live_threads->prev = &tcache;
+        }
+        live_threads = &tcache;
+        pthread_mutex_unlock(&stats_lock);
+    }
+}
+
+// The calling thread's arena, picked on first use either round-robin or
+// by the CPU the thread happens to be running on.
+static nu_arena *
+my_arena()
+{
+    if (tcache.arena == NULL)
+    {
+        // Pick among the arenas of this thread's node: node, node +
+        // node_count, node + 2 * node_count, ...
+        int cpu;
+        int node = nu_current_node(&cpu);
+        int choices = (arena_count - node + node_count - 1) / node_count;
+        int k;
+        if (arena_by_cpu)
+        {
+            k = (cpu / node_count) % choices;
+        }
+        else
+        {
+            k = __atomic_fetch_add(&node_next[node], 1, __ATOMIC_RELAXED) % choices;
+        }
+        tcache.arena = &arenas[node + k * node_count];
+        tcache_register();
+    }
+    return tcache.arena;
+}
+
+// Refills this thread's cache of class cls, from a batch or the slabs.
+// Returns 0 when memory runs out.
+static int
+tcache_refill(int cls)
+{
+    nu_arena *arena = my_arena();
+    nu_tcache_bin *tb = &tcache.bins[cls];
+
+    tcache.stats.tcache_misses += 1;
+    tcache_register();
+
+    void *batch = nu_batch_pop(arena, cls);
+    if (batch != NULL)
+    {
+        tcache.stats.batch_hits += 1;
+        tb->head = batch;
+        tb->count += TCACHE_BATCH;
+        // Remote frees are otherwise only drained under the lock, which
+        // a thread living off batches may never take.
+        if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL
+            && pthread_mutex_trylock(&arena->lock) == 0)
+        {
+            nu_remote_drain(arena);
+            pthread_mutex_unlock(&arena->lock);
+        }
+        return 1;
+    }
+
+    nu_lock(arena);
+    nu_remote_drain(arena);
+    int taken = nu_slab_take(arena, cls, &tb->head, TCACHE_BATCH);
+    tb->count += taken;
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+    return taken > 0;
+}
+
+// Makes sure this thread's cache holds at least count objects of class
+// cls, topping it up under a single lock round-trip, for callers that
+// take many objects at once. It holds fewer when memory runs out.
+static nu_tcache_bin *
+tcache_reserve(int cls, size_t count)
+{
+    nu_tcache_bin *tb = &tcache.bins[cls];
+    if ((size_t)tb->count >= count)
+    {
+        tcache.stats.tcache_hits += 1;
+        return tb;
+    }
+
+    nu_arena *arena = my_arena();
+    tcache.stats.tcache_misses += 1;
+    nu_lock(arena);
+    nu_remote_drain(arena);
+    // The cache counts in an int; a request past that comes up short
+    // as if memory had run out.
+    size_t want = count - tb->count;
+    if (want > (size_t)(INT_MAX - tb->count))
+    {
+        want = INT_MAX - tb->count;
+    }
+    tb->count += nu_slab_take(arena, cls, &tb->head, (int)want);
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+    return tb;
+}
+
+// Rounds a large mapping up to 1, 1.25, 1.5 or 1.75 times a power of
+// two pages and returns its cache bucket, or -1 if it is too big to
+// cache.
+static int
+nu_large_class(int64_t *bytes)
+{
+    int64_t pages = (*bytes + 4095) / 4096;
+    if (pages < 4)
+    {
+        *bytes = pages * 4096;
+        return (int)pages - 1;
+    }
+
+    int k = 63 - __builtin_clzll(pages);
+    int64_t step = 1L << (k - 2);
+    pages = (pages + step - 1) & ~(step - 1);
+    k = 63 - __builtin_clzll(pages);
+    *bytes = pages * 4096;
+
+    int b = 4 * (k - 2) + (int)(pages >> (k - 2)) - 4 + 3;
+    return b < LARGE_BUCKETS ? b : -1;
+}
+
+static void
+nu_large_unlink(int b, nu_chunk *chunk)
+{
+    nu_large_bucket *bucket = &large_cache[b];
+    if (chunk->prev != NULL)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
+    {
+        bucket->head = chunk->next;
+    }
+    if (chunk->next != NULL)
+    {
+        chunk->next->prev = chunk->prev;
+    }
+    else
+    {
+        bucket->tail = chunk->prev;
+    }
+    large_cache_bytes -= chunk->size;
+}
+
+// Live large allocations are kept on large_live, through the same links
+// the cache uses. Caller holds large_lock.
+static void
+nu_large_track(nu_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = large_live;
+    if (large_live != NULL)
+    {
+        large_live->prev = chunk;
+    }
+    large_live = chunk;
+}
+
+static void
+nu_large_untrack(nu_chunk *chunk)
+{
+    if (chunk->prev != NULL)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
+    {
+        large_live = chunk->next;
+    }
+    if (chunk->next != NULL)
+    {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+static void
+nu_large_unmap(nu_chunk *chunk)
+{
+    int64_t map_size = chunk->size;
+    munmap((void *)chunk, map_size);
+    __atomic_fetch_add(&nu_pages_unmapped, map_size / 4096, __ATOMIC_RELAXED);
+}
+
+// Evicts stale entries, and the oldest ones while the cache is over
+// budget, onto the list at *out for unmapping once the lock is dropped.
+// Caller holds large_lock.
+static void
+nu_large_trim(nu_chunk **out)
+{
+    int64_t cutoff = chunk_decay_ms < 0 ? INT64_MIN : nu_now_ms() - chunk_decay_ms;
+    for (;;)
+    {
+        int oldest = -1;
+        for (int b = 0; b < LARGE_BUCKETS; b++)
+        {
+            nu_chunk *tail = large_cache[b].tail;
+            if (tail != NULL && (oldest < 0 || tail->stamp < large_cache[oldest].tail->stamp))
+            {
+                oldest = b;
+            }
+        }
+        if (oldest < 0)
+        {
+            return;
+        }
+
+        nu_chunk *chunk = large_cache[oldest].tail;
+        if (large_cache_bytes <= large_cache_budget && chunk->stamp > cutoff)
+        {
+            return;
+        }
+        nu_large_unlink(oldest, chunk);
+        chunk->next = *out;
+        *out = chunk;
+    }
+}
+
+// Takes the smallest cached mapping of at least map_size bytes, a size
+// from nu_large_class(), and puts it on large_live. A bigger one keeps
+// up to a huge page of slack, already resident and there to grow into;
+// beyond that its tail is unmapped down to map_size. Returns NULL when
+// nothing cached is big enough.
+static nu_chunk *
+nu_large_reuse(int b, int64_t map_size)
+{
+    while (b < LARGE_BUCKETS && __atomic_load_n(&large_cache[b].head, __ATOMIC_RELAXED) == NULL)
+    {
+        b++;
+    }
+    if (b == LARGE_BUCKETS)
+    {
+        return NULL;
+    }
+
+    nu_chunk *chunk = NULL;
+    pthread_mutex_lock(&large_lock);
+    for (; b < LARGE_BUCKETS && chunk == NULL; b++)
+    {
+        chunk = large_cache[b].head;
+        if (chunk != NULL)
+        {
+            nu_large_unlink(b, chunk);
+            nu_large_track(chunk);
+        }
+    }
+    pthread_mutex_unlock(&large_lock);
+
+    if (chunk != NULL && chunk->size - map_size > HUGE_PAGE)
+    {
+        munmap((void *)chunk + map_size, chunk->size - map_size);
+        __atomic_fetch_add(&nu_pages_unmapped, (chunk->size - map_size) / 4096, __ATOMIC_RELAXED);
+        chunk->size = map_size;
+    }
+    return chunk;
+}
+
+// Maps a large allocation whose user pointer is a multiple of align.
+// The descriptor goes at the start of the mapping, and the pointer either
+// on the same page or, for alignments above a page, at the start of the
+// next one. Mappings are sized by nu_large_class() so they can be cached.
+static void *
+nu_large_alloc(int64_t size, int64_t align)
+{
+    // A thread may only ever use large mappings; its stats count too.
+    tcache_register();
+    int64_t offset = align > CHUNK_SIZE ? CHUNK_SIZE : (sizeof(nu_chunk) + align - 1) & ~(align - 1);
+    int64_t map_size = offset + size;
+    int b = nu_large_class(&map_size);
+    nu_chunk *chunk = NULL;
+
+    if (b >= 0 && align <= CHUNK_SIZE)
+    {
+        chunk = nu_large_reuse(b, map_size);
+    }
+
+    if (chunk != NULL)
+    {
+        tcache.stats.large_hits += 1;
+        chunk->used = 0;
+    }
+    else
+    {
+        int64_t extra = align > CHUNK_SIZE ? align : 0;
+        tcache.stats.large_misses += 1;
+        void *addr = mmap(0, map_size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (extra > 0)
+        {
+            // Trim the over-allocation so the page before the aligned
+            // pointer starts the mapping.
+            void *ptr = (void *)(((uintptr_t)addr + offset + align - 1) & ~(uintptr_t)(align - 1));
+            void *start = ptr - offset;
+            if (start > addr)
+            {
+                munmap(addr, start - addr);
+            }
+            if (start + map_size < addr + map_size + extra)
+            {
+                munmap(start + map_size, (addr + map_size + extra) - (start + map_size));
+            }
+            addr = start;
+        }
+        if (huge_mode != HUGE_OFF && map_size >= HUGE_PAGE)
+        {
+            madvise(addr, map_size, MADV_HUGEPAGE);
+        }
+        nu_node_bind(addr, map_size, my_arena()->node);
+        __atomic_fetch_add(&nu_mmap_calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&nu_pages_mapped, map_size / 4096, __ATOMIC_RELAXED);
+        chunk = (nu_chunk *)addr;
+        chunk->size = map_size;
+        chunk->used = 1;
+        pthread_mutex_lock(&large_lock);
+        nu_large_track(chunk);
+        pthread_mutex_unlock(&large_lock);
+    }
+
+    chunk->arena = NULL;
+    chunk->kind = CHUNK_LARGE;
+    chunk->sampled = 0;
+    chunk->offset = offset;
+    chunk->stamp = size;
+    __atomic_fetch_add(&nu_malloc_chunks, 1, __ATOMIC_RELAXED);
+    tcache.stats.allocs[STAT_LARGE] += 1;
+    tcache.stats.bytes_allocated += chunk->size;
+    return (void *)chunk + offset;
+}
+
+static void
+nu_large_free(nu_chunk *chunk)
+{
+    tcache_register();
+    int64_t map_size = chunk->size;
+    int b = nu_large_class(&map_size);
+    __atomic_fetch_add(&nu_free_chunks, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&large_lock);
+    nu_large_untrack(chunk);
+    if (b < 0 || map_size != chunk->size || chunk->size > large_cache_budget)
+    {
+        pthread_mutex_unlock(&large_lock);
+        nu_large_unmap(chunk);
+        return;
+    }
+
+    nu_chunk *evicted = NULL;
+    nu_large_bucket *bucket = &large_cache[b];
+    chunk->stamp = nu_now_ms();
+    chunk->prev = NULL;
+    chunk->next = bucket->head;
+    if (chunk->next != NULL)
+    {
+        chunk->next->prev = chunk;
+    }
+    else
+    {
+        bucket->tail = chunk;
+    }
+    bucket->head = chunk;
+    large_cache_bytes += chunk->size;
+    nu_large_trim(&evicted);
+    pthread_mutex_unlock(&large_lock);
+
+    while (evicted != NULL)
+    {
+        nu_chunk *next = evicted->next;
+        nu_large_unmap(evicted);
+        evicted = next;
+    }
+}
+
+// CPUs this process may run on, without sysconf(), which may allocate.
+static long
+nu_cpu_count()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        return CPU_COUNT(&set);
+    }
+    return 1;
+}
+
+// Heap profiling. With OMEM_PROF_RATE=N each thread samples about one
+// allocation per N bytes: the gaps between sampled bytes are drawn from
+// an exponential distribution, so every byte is equally likely to be the
+// one picked, and bigger allocations are sampled more often. A sample
+// keeps the allocation's call stack in a side table, keyed by pointer,
+// until the allocation is freed; chunks holding samples are flagged so
+// that other frees skip the table. Samples with the same stack share a
+// bucket that counts both the ones still live and all ever taken, which
+// is what oprof_dump() writes out.
+#define PROF_DEPTH 32
+#define PROF_LIVE_SLOTS 4096
+#define PROF_BUCKET_SLOTS 1024
+
+typedef struct nu_prof_bucket
+{
+    struct nu_prof_bucket *next;
+    uint64_t hash;
+    int depth;
+    void *stack[PROF_DEPTH];
+    long live_count;
+    long live_bytes;
+    long alloc_count;
+    long alloc_bytes;
+} nu_prof_bucket;
+
+typedef struct nu_prof_sample
+{
+    struct nu_prof_sample *next;
+    void *ptr;
+    int64_t size;
+    nu_prof_bucket *bucket;
+} nu_prof_sample;
+
+static int64_t prof_rate = 0;
+static const char *prof_prefix = "omem";
+static int prof_dumps = 0;
+static volatile sig_atomic_t prof_dump_pending = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static nu_prof_sample *prof_live[PROF_LIVE_SLOTS];
+static nu_prof_bucket *prof_buckets[PROF_BUCKET_SLOTS];
+static nu_prof_sample *prof_spare;
+static char *prof_space;
+static int64_t prof_space_left;
+
+// Side-table memory comes from its own mappings, so that profiling never
+// allocates through omalloc. Caller holds prof_lock.
+static void *
+nu_prof_carve(int64_t size)
+{
+    if (prof_space_left < size)
+    {
+        void *addr = mmap(0, REGION_MIN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+        {
+            return NULL;
+        }
+        prof_space = addr;
+        prof_space_left = REGION_MIN;
+    }
+    void *ptr = prof_space;
+    prof_space += size;
+    prof_space_left -= size;
+    return ptr;
+}
+
+static int
+nu_prof_slot(void *ptr)
+{
+    return (int)(((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 52) & (PROF_LIVE_SLOTS - 1);
+}
+
+// Natural log of x > 0, good to about 1e-5, so as not to need libm.
+static double
+nu_log(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int)(bits >> 52) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+
+    // ln(m) = 2 atanh((m - 1) / (m + 1)) for the mantissa m in [1, 2)
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    return e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+}
+
+// Bytes until this thread's next sample, exponentially distributed with
+// mean prof_rate.
+static int64_t
+nu_prof_interval()
+{
+    uint64_t x = tcache.prof_seed;
+    if (x == 0)
+    {
+        x = ((uintptr_t)&tcache ^ (uint64_t)nu_now_ms() << 20) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tcache.prof_seed = x;
+
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    return (int64_t)(-nu_log(u) * prof_rate) + 1;
+}
+
+// Records a sample for ptr, an allocation of size bytes, and draws the
+// next interval. Also the first call on every thread, to find out
+// whether profiling is on at all.
+static void __attribute__((noinline))
+nu_prof_take(void *ptr, int64_t size)
+{
+    if (!__atomic_load_n(&nu_ready, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    if (prof_rate == 0)
+    {
+        tcache.prof_left = INT64_MAX;
+        return;
+    }
+    tcache.prof_left = nu_prof_interval();
+
+    // backtrace() may allocate the first time it runs.
+    if (tcache.prof_busy)
+    {
+        return;
+    }
+    tcache.prof_busy = 1;
+
+    void *stack[PROF_DEPTH + 1];
+    int depth = backtrace(stack, PROF_DEPTH + 1) - 1;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 1; i <= depth; i++)
+    {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ULL;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    nu_prof_bucket **slot = &prof_buckets[hash & (PROF_BUCKET_SLOTS - 1)];
+    nu_prof_bucket *bucket = *slot;
+    while (bucket != NULL && (bucket->hash != hash || bucket->depth != depth
+                              || memcmp(bucket->stack, stack + 1, depth * sizeof(void *)) != 0))
+    {
+        bucket = bucket->next;
+    }
+    if (bucket == NULL && (bucket = nu_prof_carve(sizeof(nu_prof_bucket))) != NULL)
+    {
+        bucket->hash = hash;
+        bucket->depth = depth;
+        memcpy(bucket->stack, stack + 1, depth * sizeof(void *));
+        bucket->next = *slot;
+        *slot = bucket;
+    }
+
+    nu_prof_sample *sample = prof_spare;
+    if (sample != NULL)
+    {
+        prof_spare = sample->next;
+    }
+    else
+    {
+        sample = nu_prof_carve(sizeof(nu_prof_sample));
+    }
+
+    if (bucket != NULL && sample != NULL)
+    {
+        bucket->live_count += 1;
+        bucket->live_bytes += size;
+        bucket->alloc_count += 1;
+        bucket->alloc_bytes += size;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->bucket = bucket;
+        sample->next = prof_live[nu_prof_slot(ptr)];
+        prof_live[nu_prof_slot(ptr)] = sample;
+        __atomic_store_n(&ptr_chunk(ptr)->sampled, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    if (prof_dump_pending)
+    {
+        prof_dump_pending = 0;
+        oprof_dump(NULL);
+    }
+    tcache.prof_busy = 0;
+}
+
+// The link to ptr's sample, which is NULL if it has none. Caller holds
+// prof_lock.
+static nu_prof_sample **
+nu_prof_find(void *ptr)
+{
+    nu_prof_sample **link = &prof_live[nu_prof_slot(ptr)];
+    while (*link != NULL && (*link)->ptr != ptr)
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Drops ptr's sample, if it has one.
+static void __attribute__((noinline))
+nu_prof_drop(void *ptr)
+{
+    pthread_mutex_lock(&prof_lock);
+    nu_prof_sample **link = nu_prof_find(ptr);
+    nu_prof_sample *sample = *link;
+    if (sample != NULL)
+    {
+        *link = sample->next;
+        sample->bucket->live_count -= 1;
+        sample->bucket->live_bytes -= sample->size;
+        sample->next = prof_spare;
+        prof_spare = sample;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Takes ptr's sample, if it has one, out of the table without dropping
+// it from its bucket.
+static nu_prof_sample *
+nu_prof_detach(void *ptr)
+{
+    pthread_mutex_lock(&prof_lock);
+    nu_prof_sample **link = nu_prof_find(ptr);
+    nu_prof_sample *sample = *link;
+    if (sample != NULL)
+    {
+        *link = sample->next;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return sample;
+}
+
+// Puts a detached sample back as that of ptr, now size bytes.
+static void
+nu_prof_attach(nu_prof_sample *sample, void *ptr, int64_t size)
+{
+    pthread_mutex_lock(&prof_lock);
+    sample->bucket->live_bytes += size - sample->size;
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->next = prof_live[nu_prof_slot(ptr)];
+    prof_live[nu_prof_slot(ptr)] = sample;
+    __atomic_store_n(&ptr_chunk(ptr)->sampled, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Gives ptr's sample, if it has one, the size ptr was resized to in
+// place.
+static void __attribute__((noinline))
+nu_prof_resize(void *ptr, int64_t size)
+{
+    pthread_mutex_lock(&prof_lock);
+    nu_prof_sample *sample = *nu_prof_find(ptr);
+    if (sample != NULL)
+    {
+        sample->bucket->live_bytes += size - sample->size;
+        sample->size = size;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Counts an allocation towards this thread's next sample.
+static inline __attribute__((always_inline)) void *
+nu_prof_count(void *ptr, int64_t size)
+{
+    tcache.prof_left -= size;
+    if (__builtin_expect(tcache.prof_left < 0, 0) && ptr != NULL)
+    {
+        nu_prof_take(ptr, size);
+    }
+    return ptr;
+}
+
+// Counts count allocations of size bytes each, in ptrs[], looking at
+// them one by one only when a sample falls among them.
+static inline __attribute__((always_inline)) void
+nu_prof_count_all(void **ptrs, size_t count, int64_t size)
+{
+    if (__builtin_expect(tcache.prof_left >= (int64_t)count * size, 1))
+    {
+        tcache.prof_left -= count * size;
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        nu_prof_count(ptrs[i], size);
+    }
+}
+
+// Likewise for a NULL-terminated chain linked through the first word.
+static inline __attribute__((always_inline)) void
+nu_prof_count_chain(void *head, size_t count, int64_t size)
+{
+    if (__builtin_expect(tcache.prof_left >= (int64_t)count * size, 1))
+    {
+        tcache.prof_left -= count * size;
+        return;
+    }
+    for (void *obj = head; obj != NULL; obj = *(void **)obj)
+    {
+        nu_prof_count(obj, size);
+    }
+}
+
+// Called when an allocation changes size without moving.
+static inline __attribute__((always_inline)) void
+nu_prof_resized(nu_chunk *chunk, void *ptr, int64_t size)
+{
+    if (__builtin_expect(chunk->sampled, 0))
+    {
+        nu_prof_resize(ptr, size);
+    }
+}
+
+// Called on every free, before the memory is given back.
+static inline __attribute__((always_inline)) void
+nu_prof_forget(nu_chunk *chunk, void *ptr)
+{
+    if (__builtin_expect(chunk->sampled, 0))
+    {
+        nu_prof_drop(ptr);
+    }
+}
+
+static void
+nu_prof_signal(int sig)
+{
+    (void)sig;
+    prof_dump_pending = 1;
+}
+
+static void
+nu_prof_exit()
+{
+    oprof_dump(NULL);
+}
+
+typedef struct nu_prof_out
+{
+    int fd;
+    int len;
+    int failed;
+    char buf[4096];
+} nu_prof_out;
+
+static void
+nu_prof_flush(nu_prof_out *out)
+{
+    if (out->len > 0 && write(out->fd, out->buf, out->len) != out->len)
+    {
+        out->failed = 1;
+    }
+    out->len = 0;
+}
+
+static void
+nu_prof_printf(nu_prof_out *out, const char *fmt, ...)
+{
+    if (out->len > (int)sizeof(out->buf) - 256)
+    {
+        nu_prof_flush(out);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    out->len += vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+}
+
+// Writes the heap profile to path, or to PREFIX.PID.SEQ.heap if path is
+// NULL, in the heap_v2 text format pprof reads:
+//
+//   heap profile: LIVE: LIVE_BYTES [ALLOCS: ALLOC_BYTES] @ heap_v2/RATE
+//   LIVE: LIVE_BYTES [ALLOCS: ALLOC_BYTES] @ PC PC ...
+//   ...
+//   MAPPED_LIBRARIES:
+//   (/proc/self/maps)
+//
+// The first line is the totals, and there is one more per call stack.
+// Counts are of samples; pprof scales them back up using the rate. Use
+// -inuse_space for the live heap and -alloc_space for everything ever
+// allocated. Returns 0, or -1 if the file could not be written.
+int
+oprof_dump(const char *path)
+{
+    char name[4096];
+    if (path == NULL)
+    {
+        int seq = __atomic_fetch_add(&prof_dumps, 1, __ATOMIC_RELAXED);
+        snprintf(name, sizeof(name), "%s.%d.%04d.heap", prof_prefix, (int)getpid(), seq);
+        path = name;
+    }
+    nu_prof_out out;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd < 0)
+    {
+        return -1;
+    }
+    out.len = 0;
+    out.failed = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    long totals[4] = {0, 0, 0, 0};
+    for (int i = 0; i < PROF_BUCKET_SLOTS; i++)
+    {
+        for (nu_prof_bucket *b = prof_buckets[i]; b != NULL; b = b->next)
+        {
+            totals[0] += b->live_count;
+            totals[1] += b->live_bytes;
+            totals[2] += b->alloc_count;
+            totals[3] += b->alloc_bytes;
+        }
+    }
+    nu_prof_printf(&out, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld\n",
+                   totals[0], totals[1], totals[2], totals[3], (long)prof_rate);
+    for (int i = 0; i < PROF_BUCKET_SLOTS; i++)
+    {
+        for (nu_prof_bucket *b = prof_buckets[i]; b != NULL; b = b->next)
+        {
+            nu_prof_printf(&out, "%ld: %ld [%ld: %ld] @",
+                           b->live_count, b->live_bytes, b->alloc_count, b->alloc_bytes);
+            for (int j = 0; j < b->depth; j++)
+            {
+                nu_prof_printf(&out, " %p", b->stack[j]);
+            }
+            nu_prof_printf(&out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    nu_prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    nu_prof_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0)
+    {
+        while ((out.len = read(maps, out.buf, sizeof(out.buf))) > 0)
+        {
+            nu_prof_flush(&out);
+        }
+        out.len = 0;
+        close(maps);
+    }
+    close(out.fd);
+    return out.failed ? -1 : 0;
+}
+
+// Fork handlers: the child must not inherit a lock some other thread
+// held at the time of the fork, so every lock is taken around fork().
+static void
+nu_fork_prepare()
+{
+    for (int i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&large_lock);
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&prof_lock);
+}
+
+static void
+nu_fork_parent()
+{
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&large_lock);
+    for (int i = arena_count - 1; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+static void
+nu_fork_child()
+{
+    pthread_mutex_init(&prof_lock, 0);
+    pthread_mutex_init(&stats_lock, 0);
+    pthread_mutex_init(&large_lock, 0);
+    for (int i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, 0);
+    }
+}
+
+// Reads the arena configuration from the environment:
+//   OMEM_ARENAS=N       number of arenas (default: one per usable CPU,
+//                       and at least one per NUMA node)
+//   OMEM_NODES=N        pretend there are N NUMA nodes
+//   OMEM_ARENA_BIND=cpu bind threads by sched_getcpu() instead of
+//                       round-robin
+//   OMEM_RETAIN=N       empty chunks each arena keeps (default 16)
+//   OMEM_DECAY_MS=N     release empty chunks and cached large mappings
+//                       idle this long (default 1000, -1 to keep them
+//                       until their limit is hit)
+//   OMEM_LARGE_CACHE=N  bytes of freed large mappings kept for reuse
+//                       (default 32 MiB)
+//   OMEM_THP=1          back regions with transparent huge pages;
+//                       OMEM_THP=hugetlb tries MAP_HUGETLB first. Empty
+//                       chunks are then kept rather than released, since
+//                       giving back 4 KiB would split the huge page.
+//   OMEM_STATS=1        print oprintstats() at exit
+//   OMEM_PROF_RATE=N    sample about one allocation per N bytes for the
+//                       heap profiler, and dump a profile at exit
+//   OMEM_PROF_PREFIX=P  name dumps P.PID.SEQ.heap (default omem)
+//   OMEM_PROF_SIGNAL=N  dump a profile at the first sample after signal
+//                       N arrives
+static void
+nu_init()
+{
+    nu_initializing = 1;
+
+    for (int i = 0; i < MAX_ARENAS; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, 0);
+        arenas[i].nonempty = 0;
+        arenas[i].remote = NULL;
+        arenas[i].index = i;
+    }
+    pthread_key_create(&tcache_key, tcache_drain);
+    tcache_key_ready = 1;
+
+    long n = nu_cpu_count();
+    char *env = getenv("OMEM_ARENAS");
+    if (env != NULL)
+    {
+        n = atol(env);
+    }
+    if (n < 1)
+    {
+        n = 1;
+    }
+    if (n > MAX_ARENAS)
+    {
+        n = MAX_ARENAS;
+    }
+    node_real = nu_node_count();
+    node_count = node_real;
+    env = getenv("OMEM_NODES");
+    if (env != NULL)
+    {
+        node_count = atoi(env);
+    }
+    if (node_count < 1)
+    {
+        node_count = 1;
+    }
+    if (node_count > MAX_NODES)
+    {
+        node_count = MAX_NODES;
+    }
+    if (n < node_count)
+    {
+        n = node_count;
+    }
+    arena_count = (int)n;
+    for (int i = 0; i < MAX_ARENAS; i++)
+    {
+        arenas[i].node = i % node_count;
+    }
+
+    env = getenv("OMEM_ARENA_BIND");
+    arena_by_cpu = env != NULL && strcmp(env, "cpu") == 0;
+
+    env = getenv("OMEM_THP");
+    if (env != NULL && strcmp(env, "hugetlb") == 0)
+    {
+        huge_mode = HUGE_TLB;
+    }
+    else if (env != NULL && (strcmp(env, "madvise") == 0 || atoi(env) != 0))
+    {
+        huge_mode = HUGE_THP;
+    }
+    if (huge_mode != HUGE_OFF)
+    {
+        chunk_retain = LONG_MAX;
+        chunk_decay_ms = -1;
+    }
+
+    env = getenv("OMEM_RETAIN");
+    if (env != NULL)
+    {
+        chunk_retain = atol(env);
+    }
+    env = getenv("OMEM_DECAY_MS");
+    if (env != NULL)
+    {
+        chunk_decay_ms = atol(env);
+    }
+    env = getenv("OMEM_LARGE_CACHE");
+    if (env != NULL)
+    {
+        large_cache_budget = atol(env);
+    }
+
+    pthread_atfork(nu_fork_prepare, nu_fork_parent, nu_fork_child);
+    env = getenv("OMEM_STATS");
+    if (env != NULL && atoi(env) != 0)
+    {
+        atexit(oprintstats);
+    }
+
+    env = getenv("OMEM_PROF_PREFIX");
+    if (env != NULL)
+    {
+        prof_prefix = env;
+    }
+    env = getenv("OMEM_PROF_RATE");
+    if (env != NULL && atol(env) > 0)
+    {
+        prof_rate = atol(env);
+        atexit(nu_prof_exit);
+        env = getenv("OMEM_PROF_SIGNAL");
+        if (env != NULL && atoi(env) > 0)
+        {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = nu_prof_signal;
+            sa.sa_flags = SA_RESTART;
+            sigaction(atoi(env), &sa, NULL);
+        }
+    }
+
+    nu_initializing = 0;
+    __atomic_store_n(&nu_ready, 1, __ATOMIC_RELEASE);
+}
+
+static void
+nu_ensure_init()
+{
+    if (!__atomic_load_n(&nu_ready, __ATOMIC_ACQUIRE) && !nu_initializing)
+    {
+        pthread_once(&init_once, nu_init);
+    }
+}
+
+void *
+omalloc(size_t usize)
+{
+    if (usize > NU_SIZE_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    nu_ensure_init();
+    int64_t size = (int64_t)usize;
+
+    // Small sizes are served from this thread's cache without locking.
+    if (size <= SLAB_MAX)
+    {
+        int cls = nu_size_class(size);
+        nu_tcache_bin *tb = &tcache.bins[cls];
+        if (tb->head == NULL)
+        {
+            if (!tcache_refill(cls))
+            {
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+        else
+        {
+            tcache.stats.tcache_hits += 1;
+        }
+        void *obj = tb->head;
+        tb->head = *(void **)obj;
+        tb->count -= 1;
+        tcache.stats.allocs[cls] += 1;
+        tcache.stats.bytes_allocated += slab_sizes[cls];
+        return nu_prof_count(obj, size);
+    }
+
+    // space for size, rounded to keep cells 16-byte aligned
+    int64_t alloc_size = (size + sizeof(int64_t) + 15) & ~15;
+
+    // Too big for a block chunk: map it on its own.
+    if (alloc_size > BLOCK_MAX)
+    {
+        return nu_prof_count(nu_large_alloc(size, 16), size);
+    }
+
+    nu_arena *arena = my_arena();
+    nu_lock(arena);
+    nu_remote_drain(arena);
+    nu_free_cell *cell = nu_take_cell(arena, alloc_size);
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+    if (cell == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    tcache.stats.allocs[STAT_BLOCK] += 1;
+    tcache.stats.bytes_allocated += cell->size & ~CELL_FLAGS;
+    return nu_prof_count(((void *)cell) + sizeof(nu_header), size);
+}
+
+// Large allocations at least this big are zeroed by handing their pages
+// back to the kernel rather than writing them.
+#define ZERO_BY_MADVISE (128 * 1024)
+
+// Zeroes a recycled large allocation. Whole pages past the descriptor's
+// page are dropped with MADV_DONTNEED and fault back in as zero pages
+// when first touched, so a big calloc costs no page touches up front.
+// madvise can refuse (hugetlb mappings only drop whole huge pages), in
+// which case the pages are written after all.
+static void
+nu_large_zero(void *ptr, int64_t size)
+{
+    char *start = (char *)(((uintptr_t)ptr + 4095) & ~(uintptr_t)4095);
+    char *end = (char *)(((uintptr_t)ptr + size) & ~(uintptr_t)4095);
+
+    if (size < ZERO_BY_MADVISE || end <= start || madvise(start, end - start, MADV_DONTNEED) != 0)
+    {
+        memset(ptr, 0, size);
+        return;
+    }
+    memset(ptr, 0, start - (char *)ptr);
+    memset(end, 0, (char *)ptr + size - end);
+}
+
+// Like omalloc, but zeroed. A fresh large mapping is already zero and
+// is not written at all. In a slab or block chunk that nothing has been
+// freed into since it came from the kernel, only the words the
+// allocator itself writes are cleared: the free-list and batch links at
+// the start of the object and, for a block cell, the footer at its end.
+// Everything else is cleared with memset.
+void *
+ocalloc(size_t nmemb, size_t usize)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, usize, &bytes) || bytes > NU_SIZE_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    nu_ensure_init();
+    int64_t size = (int64_t)bytes;
+
+    int64_t alloc_size = (size + sizeof(int64_t) + 15) & ~15;
+    if (size <= SLAB_MAX || alloc_size <= BLOCK_MAX)
+    {
+        void *ptr = omalloc(bytes);
+        if (ptr == NULL)
+        {
+            return NULL;
+        }
+        nu_chunk *chunk = ptr_chunk(ptr);
+        if (!__atomic_load_n(&chunk->zeroed, __ATOMIC_RELAXED))
+        {
+            memset(ptr, 0, bytes);
+        }
+        else if (chunk->kind == CHUNK_SLAB)
+        {
+            memset(ptr, 0, 2 * sizeof(void *));
+        }
+        else
+        {
+            int64_t cell_size = ((nu_header *)(ptr - sizeof(nu_header)))->size & ~CELL_FLAGS;
+            memset(ptr, 0, 2 * sizeof(void *));
+            memset(ptr - sizeof(nu_header) + cell_size - sizeof(nu_footer), 0, sizeof(nu_footer));
+        }
+        return ptr;
+    }
+
+    void *ptr = nu_large_alloc(size, 16);
+    if (ptr != NULL && !ptr_chunk(ptr)->used)
+    {
+        nu_large_zero(ptr, size);
+    }
+    return nu_prof_count(ptr, size);
+}
+
+// Puts a freed object of our arena onto this thread's cache.
+static void
+tcache_put(int cls, void *obj)
+{
+    nu_tcache_bin *tb = &tcache.bins[cls];
+    *(void **)obj = tb->head;
+    tb->head = obj;
+    tb->count += 1;
+    if (tb->count > TCACHE_HIGH)
+    {
+        tcache_flush(&tcache, tb, TCACHE_BATCH);
+    }
+}
+
+// Counts the free of a slab object or block cell in this thread's stats.
+static void
+nu_count_free(nu_chunk *chunk, void *addr)
+{
+    if (chunk->kind == CHUNK_SLAB)
+    {
+        tcache.stats.frees[chunk->cls] += 1;
+        tcache.stats.bytes_freed += chunk->size;
+    }
+    else
+    {
+        tcache.stats.frees[STAT_BLOCK] += 1;
+        tcache.stats.bytes_freed += ((nu_header *)(addr - sizeof(nu_header)))->size & ~CELL_FLAGS;
+    }
+}
+
+// Hands an object back to the arena that owns it, which is not ours.
+static void
+nu_free_remote(nu_arena *owner, void *addr)
+{
+    if (owner->node != tcache.arena->node)
+    {
+        __atomic_fetch_add(&node_remote_frees[owner->node], 1, __ATOMIC_RELAXED);
+    }
+    nu_remote_push(owner, addr);
+}
+
+void ofree(void *addr)
+{
+    if (addr == NULL)
+    {
+        return;
+    }
+
+    nu_chunk *chunk = ptr_chunk(addr);
+    nu_prof_forget(chunk, addr);
+    nu_chunk_dirty(chunk);
+
+    if (chunk->kind == CHUNK_LARGE)
+    {
+        tcache.stats.frees[STAT_LARGE] += 1;
+        tcache.stats.bytes_freed += chunk->size;
+        nu_large_free(chunk);
+        return;
+    }
+
+    nu_count_free(chunk, addr);
+
+    // Objects owned by another arena go back to it through its remote
+    // list.
+    nu_arena *arena = chunk->arena;
+    if (arena != my_arena())
+    {
+        nu_free_remote(arena, addr);
+        return;
+    }
+
+    if (chunk->kind == CHUNK_SLAB)
+    {
+        tcache_put(chunk->cls, addr);
+        return;
+    }
+
+    nu_lock(arena);
+    nu_block_put(arena, addr);
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Bytes the caller may use at ptr.
+static size_t
+nu_usable_size(void *ptr)
+{
+    nu_chunk *chunk = ptr_chunk(ptr);
+    switch (chunk->kind)
+    {
+    case CHUNK_SLAB:
+        return chunk->size;
+    case CHUNK_LARGE:
+        return chunk->size - chunk->offset;
+    default:
+        return (((nu_header *)(ptr - sizeof(nu_header)))->size & ~CELL_FLAGS) - sizeof(nu_header);
+    }
+}
+
+// Frees ptr, which was allocated with size bytes: the size given to
+// omalloc, or to the orealloc that last returned it. For small sizes the
+// slab class comes from the argument rather than from the chunk, so only
+// the owning arena is read. Pointers from oaligned_alloc may sit in a
+// bigger class than their size and must go to ofree. Debug builds check
+// the size against the chunk.
+void
+ofree_sized(void *addr, size_t size)
+{
+    if (addr == NULL)
+    {
+        return;
+    }
+    if (size > SLAB_MAX)
+    {
+#ifndef NDEBUG
+        // A block cell is the rounded size, or up to one cell more when
+        // the rest was too small to split off; a large mapping records
+        // the size itself.
+        nu_chunk *chunk = ptr_chunk(addr);
+        int64_t alloc_size = ((int64_t)size + sizeof(int64_t) + 15) & ~15;
+        if (chunk->kind == CHUNK_LARGE)
+        {
+            assert(chunk->stamp == (int64_t)size);
+        }
+        else
+        {
+            int64_t cell_size = ((nu_header *)(addr - sizeof(nu_header)))->size & ~CELL_FLAGS;
+            assert(chunk->kind == CHUNK_BLOCK && cell_size >= alloc_size && cell_size - alloc_size < CELL_SIZE);
+        }
+#endif
+        ofree(addr);
+        return;
+    }
+
+    int cls = nu_size_class(size);
+    nu_chunk *chunk = ptr_chunk(addr);
+    assert(chunk->kind == CHUNK_SLAB && chunk->cls == cls);
+    nu_prof_forget(chunk, addr);
+    nu_chunk_dirty(chunk);
+
+    tcache.stats.frees[cls] += 1;
+    tcache.stats.bytes_freed += slab_sizes[cls];
+    nu_arena *arena = chunk->arena;
+    if (arena != my_arena())
+    {
+        nu_free_remote(arena, addr);
+        return;
+    }
+    tcache_put(cls, addr);
+}
+
+// Resizes an allocated block cell to alloc_size bytes without moving
+// it, by splitting off its tail or by absorbing a free successor.
+// Returns 0 if the successor is not free or not big enough. Caller holds
+// the arena lock.
+static int
+nu_block_resize(nu_arena *arena, nu_free_cell *cell, int64_t alloc_size)
+{
+    int64_t flags = cell->size & CELL_FLAGS;
+    int64_t size = cell->size & ~CELL_FLAGS;
+    void *end = (void *)ptr_chunk(cell) + BLOCK_START + BLOCK_MAX;
+    nu_free_cell *next = (void *)cell + size;
+
+    if (alloc_size > size)
+    {
+        if ((void *)next >= end || (next->size & CELL_USED) || size + next->size < alloc_size)
+        {
+            return 0;
+        }
+        nu_free_list_remove(arena, next);
+        size += next->size;
+        next = (void *)cell + size;
+        if ((void *)next < end)
+        {
+            next->size &= ~CELL_PREV_FREE;
+        }
+    }
+
+    if (size - alloc_size >= CELL_SIZE)
+    {
+        nu_free_cell *rest = (void *)cell + alloc_size;
+        rest->size = (size - alloc_size) | CELL_USED;
+        cell->size = alloc_size | flags;
+        nu_block_put(arena, (void *)rest + sizeof(nu_header));
+    }
+    else
+    {
+        cell->size = size | flags;
+    }
+    return 1;
+}
+
+// Takes a block cell whose payload is a multiple of align, by taking a
+// cell with room to slide the payload forward and handing back its head
+// and tail. The slack is align plus 16, since a head gap too small to be
+// a free cell has to grow by another align. Caller holds the arena lock.
+static nu_free_cell *
+nu_take_aligned_cell(nu_arena *arena, int64_t alloc_size, int64_t align)
+{
+    nu_free_cell *cell = nu_take_cell(arena, alloc_size + align + 16);
+    if (cell == NULL)
+    {
+        return NULL;
+    }
+    uintptr_t payload = (uintptr_t)cell + sizeof(nu_header);
+    uintptr_t aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
+
+    if (aligned != payload)
+    {
+        if (aligned - payload < CELL_SIZE)
+        {
+            aligned += align;
+        }
+        int64_t gap = aligned - payload;
+        int64_t size = cell->size & ~CELL_FLAGS;
+        nu_free_cell *head = cell;
+        cell = (void *)cell + gap;
+        cell->size = (size - gap) | CELL_USED;
+        head->size = gap | (head->size & CELL_PREV_FREE) | CELL_USED;
+        nu_block_put(arena, (void *)head + sizeof(nu_header));
+    }
+
+    nu_block_resize(arena, cell, alloc_size);
+    return cell;
+}
+
+// Mappings up to this size grow into a cached mapping when there is one,
+// which costs a copy but no system call; bigger ones are always moved
+// with mremap.
+#define LARGE_COPY_MAX (1L << 20)
+
+// Grows or shrinks a large mapping with mremap, letting the kernel move
+// the pages instead of copying them.
+static void *
+nu_large_resize(nu_chunk *chunk, int64_t bytes)
+{
+    tcache_register();
+    int64_t map_size = bytes + chunk->offset;
+    int64_t old_size = chunk->size;
+    int b = nu_large_class(&map_size);
+    if (b < 0)
+    {
+        map_size = (map_size + 4095) & ~4095L;
+    }
+
+    // Growing within the mapping, or shrinking by less than half, stays.
+    if (map_size <= old_size && (map_size * 2 > old_size || bytes > chunk->stamp))
+    {
+        chunk->stamp = bytes;
+        return (void *)chunk + chunk->offset;
+    }
+
+    nu_chunk *reused = NULL;
+    if (b >= 0 && map_size > old_size && old_size <= LARGE_COPY_MAX)
+    {
+        reused = nu_large_reuse(b, map_size);
+    }
+    if (reused != NULL)
+    {
+        tcache.stats.large_hits += 1;
+        reused->arena = NULL;
+        reused->kind = CHUNK_LARGE;
+        reused->sampled = 0;
+        reused->used = 0;
+        reused->offset = chunk->offset;
+        reused->stamp = bytes;
+        memcpy((void *)reused + reused->offset, (void *)chunk + chunk->offset, old_size - chunk->offset);
+        __atomic_fetch_add(&nu_malloc_chunks, 1, __ATOMIC_RELAXED);
+        nu_large_free(chunk);
+        return (void *)reused + reused->offset;
+    }
+
+    // The mapping may move, so it is off large_live meanwhile.
+    pthread_mutex_lock(&large_lock);
+    nu_large_untrack(chunk);
+    pthread_mutex_unlock(&large_lock);
+    void *addr = mremap((void *)chunk, old_size, map_size, MREMAP_MAYMOVE);
+    pthread_mutex_lock(&large_lock);
+    nu_large_track(addr == MAP_FAILED ? chunk : (nu_chunk *)addr);
+    pthread_mutex_unlock(&large_lock);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (map_size > old_size)
+    {
+        __atomic_fetch_add(&nu_pages_mapped, (map_size - old_size) / 4096, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&nu_pages_unmapped, (old_size - map_size) / 4096, __ATOMIC_RELAXED);
+    }
+
+    chunk = (nu_chunk *)addr;
+    chunk->size = map_size;
+    chunk->stamp = bytes;
+    return addr + chunk->offset;
+}
+
+// Bytes of heap an allocation takes up, as counted in the stats.
+static int64_t
+nu_footprint(void *ptr)
+{
+    nu_chunk *chunk = ptr_chunk(ptr);
+    if (chunk->kind == CHUNK_BLOCK)
+    {
+        return ((nu_header *)(ptr - sizeof(nu_header)))->size & ~CELL_FLAGS;
+    }
+    return chunk->size;
+}
+
+void *orealloc(void *prev, size_t bytes)
+{
+    if (prev == NULL)
+    {
+        return omalloc(bytes);
+    }
+    if (bytes > NU_SIZE_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    nu_chunk *chunk = ptr_chunk(prev);
+    int64_t footprint = nu_footprint(prev);
+    int64_t size = (int64_t)bytes;
+    int64_t alloc_size = (size + sizeof(int64_t) + 15) & ~15;
+
+    switch (chunk->kind)
+    {
+    case CHUNK_SLAB:
+        // Keep the object while the new size maps to the same class, so
+        // that ofree_sized() with the new size finds the right one.
+        if (size <= SLAB_MAX && nu_size_class(size) == chunk->cls)
+        {
+            nu_prof_resized(chunk, prev, size);
+            return prev;
+        }
+        break;
+    case CHUNK_LARGE:
+        if (alloc_size > BLOCK_MAX)
+        {
+            // A sample follows the mapping, moved or not. It is out of
+            // the table meanwhile, since once the old range is unmapped
+            // another thread may sample a new mapping at the same address.
+            nu_prof_sample *sample = NULL;
+            if (__builtin_expect(chunk->sampled, 0))
+            {
+                sample = nu_prof_detach(prev);
+            }
+            void *addr = nu_large_resize(chunk, size);
+            if (sample != NULL)
+            {
+                nu_prof_attach(sample, addr != NULL ? addr : prev, addr != NULL ? size : sample->size);
+            }
+            if (addr != NULL)
+            {
+                tcache.stats.bytes_freed += footprint;
+                tcache.stats.bytes_allocated += nu_footprint(addr);
+                return addr;
+            }
+        }
+        break;
+    case CHUNK_BLOCK:
+        if (size > SLAB_MAX && alloc_size <= BLOCK_MAX)
+        {
+            nu_arena *arena = chunk->arena;
+            nu_lock(arena);
+            int done = nu_block_resize(arena, (nu_free_cell *)(prev - sizeof(nu_header)), alloc_size);
+            pthread_mutex_unlock(&arena->lock);
+            if (done)
+            {
+                tcache.stats.bytes_freed += footprint;
+                tcache.stats.bytes_allocated += nu_footprint(prev);
+                nu_prof_resized(chunk, prev, size);
+                return prev;
+            }
+        }
+        break;
+    }
+
+    void *newaddr = omalloc(bytes);
+    if (newaddr == NULL)
+    {
+        return NULL;
+    }
+    size_t s = nu_usable_size(prev);
+    if (s > bytes)
+    {
+        s = bytes;
+    }
+    memcpy(newaddr, prev, s);
+    ofree(prev);
+    return newaddr;
+}
+
+size_t
+ousable_size(void *ptr)
+{
+    return ptr == NULL ? 0 : nu_usable_size(ptr);
+}
+
+// Allocates size bytes at a multiple of align, a power of two. Every
+// omalloc pointer is 16-byte aligned already. Up to SLAB_MAX the
+// smallest naturally aligned slab class that fits is used, medium sizes
+// get a block cell slid to the boundary, and the rest, including
+// anything page-aligned, is mapped on its own.
+void *
+oaligned_alloc(size_t ualign, size_t usize)
+{
+    if (ualign <= 16)
+    {
+        return omalloc(usize);
+    }
+    if ((ualign & (ualign - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (usize > NU_SIZE_MAX || ualign > NU_SIZE_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int64_t align = (int64_t)ualign;
+    int64_t size = (int64_t)usize;
+    nu_ensure_init();
+
+    if (size <= SLAB_MAX && align <= SLAB_MAX)
+    {
+        for (int cls = nu_size_class(size > align ? size : align); cls < SLAB_CLASSES; cls++)
+        {
+            if ((slab_sizes[cls] & (align - 1)) == 0)
+            {
+                return omalloc(slab_sizes[cls]);
+            }
+        }
+    }
+
+    int64_t alloc_size = (size + sizeof(nu_header) + 15) & ~15;
+    if (align >= CHUNK_SIZE || alloc_size + align + 16 > BLOCK_MAX)
+    {
+        return nu_prof_count(nu_large_alloc(size, align), size);
+    }
+
+    nu_arena *arena = my_arena();
+    nu_lock(arena);
+    nu_remote_drain(arena);
+    nu_free_cell *cell = nu_take_aligned_cell(arena, alloc_size, align);
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+    if (cell == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    tcache.stats.allocs[STAT_BLOCK] += 1;
+    tcache.stats.bytes_allocated += cell->size & ~CELL_FLAGS;
+    return nu_prof_count(((void *)cell) + sizeof(nu_header), size);
+}
+
+// posix_memalign(3) on top of oaligned_alloc.
+int
+oposix_memalign(void **out, size_t align, size_t size)
 {
-    void *newaddr = omalloc(bytes);
-    nu_header* nodepart = (void*)prev - sizeof(nu_header);
-    size_t s = nodepart->size;
-    memcpy(newaddr, prev, s);
-    ofree(prev);
-    return newaddr;
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+
+    void *ptr = oaligned_alloc(align, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+// Fixed-size pools. A pool is a handle on one slab class, shared by
+// every pool of that class, so pool objects carry no header and come
+// from the same thread caches as omalloc's, and creating one twice is
+// harmless. Sizes above SLAB_MAX get a handle of their own and fall back
+// to plain omalloc.
+struct opool
+{
+    int cls;      // slab class, or -1
+    int64_t size;
+};
+
+static opool pools[SLAB_CLASSES];
+
+opool *
+opool_create(size_t size)
+{
+    nu_ensure_init();
+    if (size > SLAB_MAX)
+    {
+        opool *pool = omalloc(sizeof(opool));
+        if (pool == NULL)
+        {
+            return NULL;
+        }
+        pool->cls = -1;
+        pool->size = size;
+        return pool;
+    }
+
+    int cls = nu_size_class(size);
+    pools[cls].cls = cls;
+    pools[cls].size = slab_sizes[cls];
+    return &pools[cls];
+}
+
+void *
+opool_alloc(opool *pool)
+{
+    return omalloc(pool->size);
+}
+
+void
+opool_free(opool *pool, void *obj)
+{
+    (void)pool;
+    ofree(obj);
+}
+
+// Allocates count objects linked through their first word, taking them
+// off the thread cache in one splice.
+void *
+opool_alloc_chain(opool *pool, size_t count)
+{
+    if (count == 0)
+    {
+        return NULL;
+    }
+    if (pool->cls < 0)
+    {
+        void *head = NULL;
+        for (size_t i = 0; i < count; i++)
+        {
+            void *obj = omalloc(pool->size);
+            if (obj == NULL)
+            {
+                opool_free_chain(pool, head, 0);
+                return NULL;
+            }
+            *(void **)obj = head;
+            head = obj;
+        }
+        return head;
+    }
+
+    int cls = pool->cls;
+    nu_tcache_bin *tb = tcache_reserve(cls, count);
+    if ((size_t)tb->count < count)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *head = tb->head;
+    void *last = head;
+    for (size_t i = 1; i < count; i++)
+    {
+        last = *(void **)last;
+    }
+    tb->head = *(void **)last;
+    *(void **)last = NULL;
+    tb->count -= count;
+    tcache.stats.allocs[cls] += count;
+    tcache.stats.bytes_allocated += count * pool->size;
+    nu_prof_count_chain(head, count, pool->size);
+    return head;
+}
+
+// Frees a chain of pool objects, each pointing to the next at
+// link_offset. Objects of this thread's arena go onto its cache and any
+// excess goes back to the slabs under one lock, rather than one ofree
+// per object.
+void
+opool_free_chain(opool *pool, void *head, size_t link_offset)
+{
+    if (pool->cls < 0)
+    {
+        while (head != NULL)
+        {
+            void *next = *(void **)(head + link_offset);
+            ofree(head);
+            head = next;
+        }
+        return;
+    }
+
+    nu_arena *arena = my_arena();
+    nu_tcache_bin *tb = &tcache.bins[pool->cls];
+    long count = 0;
+    while (head != NULL)
+    {
+        void *next = *(void **)(head + link_offset);
+        nu_chunk *chunk = ptr_chunk(head);
+        assert(chunk->kind == CHUNK_SLAB && chunk->cls == pool->cls);
+        nu_prof_forget(chunk, head);
+        nu_chunk_dirty(chunk);
+        if (chunk->arena == arena)
+        {
+            *(void **)head = tb->head;
+            tb->head = head;
+            tb->count += 1;
+        }
+        else
+        {
+            nu_free_remote(chunk->arena, head);
+        }
+        count += 1;
+        head = next;
+    }
+    tcache.stats.frees[pool->cls] += count;
+    tcache.stats.bytes_freed += count * pool->size;
+
+    if (tb->count > TCACHE_HIGH)
+    {
+        tcache_flush(&tcache, tb, tb->count - TCACHE_HIGH / 2);
+    }
+}
+
+// Allocates count objects of usize bytes into out[] with one cache or
+// arena operation for the whole batch. Returns how many were allocated,
+// which is less than count only when memory runs out.
+size_t
+omalloc_bulk(size_t usize, size_t count, void **out)
+{
+    if (usize > NU_SIZE_MAX)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    nu_ensure_init();
+    int64_t size = (int64_t)usize;
+
+    if (size <= SLAB_MAX)
+    {
+        int cls = nu_size_class(size);
+        nu_tcache_bin *tb = tcache_reserve(cls, count);
+        if ((size_t)tb->count < count)
+        {
+            errno = ENOMEM;
+            count = tb->count;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = tb->head;
+            tb->head = *(void **)tb->head;
+        }
+        tb->count -= count;
+        tcache.stats.allocs[cls] += count;
+        tcache.stats.bytes_allocated += count * slab_sizes[cls];
+        nu_prof_count_all(out, count, size);
+        return count;
+    }
+
+    int64_t alloc_size = (size + sizeof(int64_t) + 15) & ~15;
+    if (alloc_size > BLOCK_MAX)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = nu_prof_count(nu_large_alloc(size, 16), size);
+            if (out[i] == NULL)
+            {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    nu_arena *arena = my_arena();
+    nu_lock(arena);
+    nu_remote_drain(arena);
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        nu_free_cell *cell = nu_take_cell(arena, alloc_size);
+        if (cell == NULL)
+        {
+            errno = ENOMEM;
+            break;
+        }
+        tcache.stats.bytes_allocated += cell->size & ~CELL_FLAGS;
+        out[i] = (void *)cell + sizeof(nu_header);
+    }
+    nu_arena_decay(arena);
+    pthread_mutex_unlock(&arena->lock);
+    tcache.stats.allocs[STAT_BLOCK] += i;
+    nu_prof_count_all(out, i, size);
+    return i;
+}
+
+// Frees count pointers of any sizes. Slab objects go onto this thread's
+// cache, block cells of our arena back to its bins under one lock, and
+// anything that overflows the cache back to the slabs under one more.
+void
+ofree_bulk(void **ptrs, size_t count)
+{
+    nu_arena *arena = my_arena();
+    void *blocks = NULL;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        void *addr = ptrs[i];
+        if (addr == NULL)
+        {
+            continue;
+        }
+
+        nu_chunk *chunk = ptr_chunk(addr);
+        nu_prof_forget(chunk, addr);
+        nu_chunk_dirty(chunk);
+    nu_chunk_dirty(chunk);
+        if (chunk->kind == CHUNK_LARGE)
+        {
+            tcache.stats.frees[STAT_LARGE] += 1;
+            tcache.stats.bytes_freed += chunk->size;
+            nu_large_free(chunk);
+            continue;
+        }
+
+        nu_count_free(chunk, addr);
+        if (chunk->arena != arena)
+        {
+            nu_free_remote(chunk->arena, addr);
+        }
+        else if (chunk->kind == CHUNK_SLAB)
+        {
+            nu_tcache_bin *tb = &tcache.bins[chunk->cls];
+            *(void **)addr = tb->head;
+            tb->head = addr;
+            tb->count += 1;
+        }
+        else
+        {
+            *(void **)addr = blocks;
+            blocks = addr;
+        }
+    }
+
+    if (blocks != NULL)
+    {
+        nu_lock(arena);
+        while (blocks != NULL)
+        {
+            void *next = *(void **)blocks;
+            nu_block_put(arena, blocks);
+            blocks = next;
+        }
+        nu_arena_decay(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    for (int cls = 0; cls < SLAB_CLASSES; cls++)
+    {
+        nu_tcache_bin *tb = &tcache.bins[cls];
+        if (tb->count > TCACHE_HIGH)
+        {
+            tcache_flush(&tcache, tb, tb->count - TCACHE_HIGH / 2);
+        }
+    }
+}
+
+om_stats *
+ogetstats()
+{
+    static om_stats stats;
+    nu_stats sum;
+
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&stats_lock);
+    nu_stats_add(&sum, &dead_threads);
+    for (nu_tcache *tc = live_threads; tc != NULL; tc = tc->next)
+    {
+        nu_stats_add(&sum, &tc->stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    memset(&stats, 0, sizeof(stats));
+    stats.pages_mapped = __atomic_load_n(&nu_pages_mapped, __ATOMIC_RELAXED);
+    stats.pages_unmapped = __atomic_load_n(&nu_pages_unmapped, __ATOMIC_RELAXED);
+    stats.chunks_allocated = __atomic_load_n(&nu_malloc_chunks, __ATOMIC_RELAXED);
+    stats.chunks_freed = __atomic_load_n(&nu_free_chunks, __ATOMIC_RELAXED);
+    stats.mmap_calls = __atomic_load_n(&nu_mmap_calls, __ATOMIC_RELAXED);
+    for (int i = 0; i < arena_count; i++)
+    {
+        stats.free_length += __atomic_load_n(&arenas[i].empty_count, __ATOMIC_RELAXED);
+    }
+
+    stats.bytes_in_use = sum.bytes_allocated - sum.bytes_freed;
+    stats.bytes_mapped = (stats.pages_mapped - stats.pages_unmapped) * 4096;
+    stats.lock_acquired = sum.lock_acquired;
+    stats.lock_contended = sum.lock_contended;
+    stats.tcache_hits = sum.tcache_hits;
+    stats.batch_hits = sum.batch_hits;
+    stats.tcache_misses = sum.tcache_misses;
+    stats.large_hits = sum.large_hits;
+    stats.large_misses = sum.large_misses;
+
+    stats.node_count = node_count;
+    for (int i = 0; i < arena_count; i++)
+    {
+        stats.node_arenas[arenas[i].node] += 1;
+    }
+    for (int i = 0; i < node_count; i++)
+    {
+        stats.node_pages[i] = __atomic_load_n(&node_pages[i], __ATOMIC_RELAXED);
+        stats.node_remote_frees[i] = __atomic_load_n(&node_remote_frees[i], __ATOMIC_RELAXED);
+    }
+
+    stats.class_count = STAT_CLASSES;
+    for (int i = 0; i < STAT_CLASSES; i++)
+    {
+        stats.class_size[i] = i < SLAB_CLASSES ? slab_sizes[i] : 0;
+        stats.class_allocs[i] = sum.allocs[i];
+        stats.class_frees[i] = sum.frees[i];
+    }
+    return &stats;
+}
+
+static double
+nu_ratio(long part, long whole)
+{
+    return whole > 0 ? (double)part / whole : 0.0;
+}
+
+void
+oprintstats()
+{
+    om_stats *stats = ogetstats();
+    fprintf(stderr, "\n== omem stats ==\n");
+    fprintf(stderr, "Mapped:     %ld pages\n", stats->pages_mapped);
+    fprintf(stderr, "Unmapped:   %ld pages\n", stats->pages_unmapped);
+    fprintf(stderr, "mmap calls: %ld\n", stats->mmap_calls);
+    fprintf(stderr, "Large:      %ld allocs, %ld frees\n", stats->chunks_allocated, stats->chunks_freed);
+    fprintf(stderr, "Empty:      %ld chunks\n", stats->free_length);
+    fprintf(stderr, "In use:     %ld bytes\n", stats->bytes_in_use);
+    fprintf(stderr, "Held:       %ld bytes\n", stats->bytes_mapped);
+    fprintf(stderr, "Frag:       %.1f%%\n",
+            100.0 * (1.0 - nu_ratio(stats->bytes_in_use, stats->bytes_mapped)));
+    fprintf(stderr, "Locks:      %ld taken, %ld contended (%.1f%%)\n",
+            stats->lock_acquired, stats->lock_contended,
+            100.0 * nu_ratio(stats->lock_contended, stats->lock_acquired));
+    fprintf(stderr, "tcache:     %ld hits, %ld misses (%.1f%% hit)\n",
+            stats->tcache_hits, stats->tcache_misses,
+            100.0 * nu_ratio(stats->tcache_hits, stats->tcache_hits + stats->tcache_misses));
+    fprintf(stderr, "Batches:    %ld of the misses lock-free (%.1f%%)\n",
+            stats->batch_hits, 100.0 * nu_ratio(stats->batch_hits, stats->tcache_misses));
+    fprintf(stderr, "Big cache:  %ld hits, %ld misses (%.1f%% hit)\n",
+            stats->large_hits, stats->large_misses,
+            100.0 * nu_ratio(stats->large_hits, stats->large_hits + stats->large_misses));
+    fprintf(stderr, "%-10s %12s %12s %12s\n", "node", "arenas", "pages", "remote frees");
+    for (int i = 0; i < stats->node_count; i++)
+    {
+        fprintf(stderr, "%-10d %12ld %12ld %12ld\n", i, stats->node_arenas[i],
+                stats->node_pages[i], stats->node_remote_frees[i]);
+    }
+    fprintf(stderr, "Classes:    %d slab, " SIZE_CLASS_SCHEME "\n", SLAB_CLASSES);
+    fprintf(stderr, "%-10s %12s %12s\n", "class", "allocs", "frees");
+    for (int i = 0; i < stats->class_count; i++)
+    {
+        char name[24];
+        if (stats->class_size[i] > 0)
+        {
+            snprintf(name, sizeof(name), "%ld", stats->class_size[i]);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s", i == STAT_BLOCK ? "block" : "large");
+        }
+        fprintf(stderr, "%-10s %12ld %12ld\n", name, stats->class_allocs[i], stats->class_frees[i]);
+    }
+}
+
+// Heap walking. Chunks are described into a small batch under their
+// arena's lock, and visit() runs over the batch once the lock is
+// dropped, so it may allocate and no arena is held for more than
+// WALK_BATCH chunks. Large mappings are all copied out at once. Chunks
+// carved or freed meanwhile may or may not be seen.
+#define WALK_BATCH 16
+#define WALK_FREE_MAX (4096 / 32) // free cells are 32 bytes or more
+
+typedef struct nu_walk_batch
+{
+    int count;
+    om_chunk_info info[WALK_BATCH];
+    size_t free_sizes[WALK_BATCH][WALK_FREE_MAX];
+} nu_walk_batch;
+
+// Caller holds the arena lock.
+static void
+nu_describe_chunk(nu_arena *arena, nu_chunk *chunk, om_chunk_info *info, size_t *free_sizes)
+{
+    memset(info, 0, sizeof(*info));
+    info->addr = chunk;
+    info->size = CHUNK_SIZE;
+    info->arena = arena->index;
+
+    if (chunk->kind == CHUNK_EMPTY)
+    {
+        info->kind = OM_CHUNK_EMPTY;
+        info->free_bytes = CHUNK_SIZE;
+    }
+    else if (chunk->kind == CHUNK_SLAB)
+    {
+        int64_t size = chunk->size;
+        int64_t start = slab_start[chunk->cls];
+        int64_t capacity = slab_objects[chunk->cls];
+        long listed = 0;
+        for (void *obj = chunk->free; obj != NULL; obj = *(void **)obj)
+        {
+            listed++;
+        }
+        info->kind = OM_CHUNK_SLAB;
+        info->obj_size = size;
+        info->live = chunk->used;
+        info->free = listed + ((char *)chunk + start + capacity * size - chunk->fresh) / size;
+        info->live_bytes = info->live * size;
+        info->free_bytes = info->free * size;
+        info->overhead_bytes = CHUNK_SIZE - capacity * size;
+    }
+    else
+    {
+        info->kind = OM_CHUNK_BLOCK;
+        info->free_sizes = free_sizes;
+        info->overhead_bytes = CHUNK_SIZE - BLOCK_MAX;
+        void *end = (void *)chunk + BLOCK_START + BLOCK_MAX;
+        for (void *cell = (void *)chunk + BLOCK_START; cell < end;)
+        {
+            int64_t header = ((nu_header *)cell)->size;
+            int64_t size = header & ~CELL_FLAGS;
+            if (header & CELL_USED)
+            {
+                info->live += 1;
+                info->live_bytes += size - sizeof(nu_header);
+                info->overhead_bytes += sizeof(nu_header);
+            }
+            else
+            {
+                free_sizes[info->free++] = size;
+                info->free_bytes += size;
+            }
+            cell += size;
+        }
+    }
+}
+
+static void
+nu_walk_visit(nu_walk_batch *batch, om_walk_fn visit, void *arg)
+{
+    for (int i = 0; i < batch->count; i++)
+    {
+        visit(&batch->info[i], arg);
+    }
+    batch->count = 0;
+}
+
+// Counts the mappings on large_live and in the cache buckets. Caller
+// holds large_lock.
+static long
+nu_large_count()
+{
+    long count = 0;
+    for (int b = -1; b < LARGE_BUCKETS; b++)
+    {
+        for (nu_chunk *chunk = b < 0 ? large_live : large_cache[b].head; chunk != NULL; chunk = chunk->next)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Describes up to max mappings into info[], those on large_live first
+// and then the cached ones, in one pass. Returns how many. Caller holds
+// large_lock.
+static long
+nu_describe_large(om_chunk_info *info, long max)
+{
+    long n = 0;
+    for (int b = -1; b < LARGE_BUCKETS; b++)
+    {
+        nu_chunk *chunk = b < 0 ? large_live : large_cache[b].head;
+        for (; chunk != NULL && n < max; chunk = chunk->next, n++)
+        {
+            memset(&info[n], 0, sizeof(info[n]));
+            info[n].addr = chunk;
+            info[n].size = chunk->size;
+            info[n].arena = -1;
+            if (b >= 0)
+            {
+                info[n].kind = OM_CHUNK_CACHED;
+                info[n].free = 1;
+                info[n].free_bytes = chunk->size;
+            }
+            else
+            {
+                info[n].kind = OM_CHUNK_LARGE;
+                info[n].obj_size = chunk->stamp;
+                info[n].live = 1;
+                info[n].live_bytes = chunk->stamp;
+                info[n].overhead_bytes = chunk->size - chunk->stamp;
+            }
+        }
+    }
+    return n;
+}
+
+void
+oheap_walk(om_walk_fn visit, void *arg)
+{
+    nu_ensure_init();
+    nu_walk_batch batch;
+    batch.count = 0;
+
+    for (int a = 0; a < arena_count; a++)
+    {
+        nu_arena *arena = &arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        // Objects freed from other threads still count as used in their
+        // slabs until the remote list is drained.
+        nu_remote_drain(arena);
+        nu_region *region = arena->regions;
+        int64_t offset = CHUNK_SIZE;
+        while (region != NULL)
+        {
+            if (offset >= region->bump)
+            {
+                region = region->anext;
+                offset = CHUNK_SIZE;
+                continue;
+            }
+
+            int64_t i = offset / CHUNK_SIZE;
+            nu_chunk *chunk = (nu_chunk *)((void *)region + offset);
+            offset += CHUNK_SIZE;
+            if (region->bitmap[i / 64] & (1ULL << (i % 64)))
+            {
+                continue;
+            }
+            nu_describe_chunk(arena, chunk, &batch.info[batch.count], batch.free_sizes[batch.count]);
+            batch.count += 1;
+
+            if (batch.count == WALK_BATCH)
+            {
+                pthread_mutex_unlock(&arena->lock);
+                nu_walk_visit(&batch, visit, arg);
+                pthread_mutex_lock(&arena->lock);
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+        nu_walk_visit(&batch, visit, arg);
+    }
+
+    // Large mappings are copied out under large_lock in one pass, into a
+    // snapshot mapped for the purpose, with room for a few made after
+    // they were counted. Should the mmap fail, only a batch is seen.
+    pthread_mutex_lock(&large_lock);
+    long max = nu_large_count() + WALK_BATCH;
+    pthread_mutex_unlock(&large_lock);
+    size_t bytes = (max * sizeof(om_chunk_info) + 4095) & ~(size_t)4095;
+    om_chunk_info *snap = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (snap == MAP_FAILED)
+    {
+        snap = batch.info;
+        max = WALK_BATCH;
+    }
+
+    pthread_mutex_lock(&large_lock);
+    long count = nu_describe_large(snap, max);
+    pthread_mutex_unlock(&large_lock);
+    for (long i = 0; i < count; i++)
+    {
+        visit(&snap[i], arg);
+    }
+    if (snap != batch.info)
+    {
+        munmap(snap, bytes);
+    }
+}
+
+static void
+nu_report_chunk(const om_chunk_info *chunk, void *arg)
+{
+    om_heap_report *report = arg;
+    om_arena_report *ar = chunk->arena >= 0 ? &report->arenas[chunk->arena] : &report->total;
+
+    if (chunk->kind == OM_CHUNK_LARGE)
+    {
+        report->large_count += 1;
+        report->large_bytes += chunk->size;
+        report->large_requested += chunk->obj_size;
+    }
+    else if (chunk->kind == OM_CHUNK_CACHED)
+    {
+        report->large_cached += 1;
+        report->large_cached_bytes += chunk->size;
+    }
+    else
+    {
+        ar->chunks += 1;
+    }
+    if (chunk->kind == OM_CHUNK_EMPTY)
+    {
+        ar->empty_chunks += 1;
+    }
+    ar->held_bytes += chunk->size;
+    ar->live_bytes += chunk->live_bytes;
+    ar->free_bytes += chunk->free_bytes;
+    ar->overhead_bytes += chunk->overhead_bytes;
+    if (chunk->kind == OM_CHUNK_BLOCK)
+    {
+        for (long i = 0; i < chunk->free; i++)
+        {
+            ar->free_cell_bytes += chunk->free_sizes[i];
+            if (chunk->free_sizes[i] > ar->largest_free)
+            {
+                ar->largest_free = chunk->free_sizes[i];
+            }
+        }
+    }
+}
+
+static void
+nu_report_ratios(om_arena_report *ar)
+{
+    ar->external_frag = nu_ratio(ar->free_bytes, ar->held_bytes);
+    ar->internal_waste = nu_ratio(ar->overhead_bytes, ar->held_bytes);
+    ar->block_frag = ar->free_cell_bytes == 0 ? 0 : 1.0 - nu_ratio(ar->largest_free, ar->free_cell_bytes);
+}
+
+// Walks the heap and sums it up per arena. Objects in thread caches and
+// batch stacks are counted from their counters, which their threads
+// update without a lock, so that part is approximate.
+om_heap_report *
+oheap_report()
+{
+    static om_heap_report report;
+    memset(&report, 0, sizeof(report));
+    oheap_walk(nu_report_chunk, &report);
+    report.arena_count = arena_count;
+
+    // Objects cached above the slabs are free, though their slabs count
+    // them as handed out.
+    size_t cached[MAX_ARENAS];
+    memset(cached, 0, sizeof(cached));
+    pthread_mutex_lock(&stats_lock);
+    for (nu_tcache *tc = live_threads; tc != NULL; tc = tc->next)
+    {
+        for (int cls = 0; cls < SLAB_CLASSES && tc->arena != NULL; cls++)
+        {
+            cached[tc->arena->index] += __atomic_load_n(&tc->bins[cls].count, __ATOMIC_RELAXED) * slab_sizes[cls];
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (int a = 0; a < arena_count; a++)
+    {
+        om_arena_report *ar = &report.arenas[a];
+        for (int cls = 0; cls < SLAB_CLASSES; cls++)
+        {
+            long depth = __atomic_load_n(&arenas[a].batch_depth[cls], __ATOMIC_RELAXED);
+            cached[a] += depth * TCACHE_BATCH * slab_sizes[cls];
+        }
+        if (cached[a] > ar->live_bytes)
+        {
+            cached[a] = ar->live_bytes;
+        }
+        ar->cached_bytes = cached[a];
+        ar->live_bytes -= cached[a];
+        ar->free_bytes += cached[a];
+        ar->released_chunks = __atomic_load_n(&arenas[a].released, __ATOMIC_RELAXED);
+
+        report.total.chunks += ar->chunks;
+        report.total.empty_chunks += ar->empty_chunks;
+        report.total.released_chunks += ar->released_chunks;
+        report.total.held_bytes += ar->held_bytes;
+        report.total.live_bytes += ar->live_bytes;
+        report.total.free_bytes += ar->free_bytes;
+        report.total.overhead_bytes += ar->overhead_bytes;
+        report.total.cached_bytes += ar->cached_bytes;
+        report.total.free_cell_bytes += ar->free_cell_bytes;
+        if (ar->largest_free > report.total.largest_free)
+        {
+            report.total.largest_free = ar->largest_free;
+        }
+        nu_report_ratios(ar);
+    }
+    nu_report_ratios(&report.total);
+    return &report;
+}
+
+void
+oprintheap()
+{
+    om_heap_report *report = oheap_report();
+    fprintf(stderr, "\n== omem heap ==\n");
+    fprintf(stderr, "%-6s %8s %8s %10s %10s %10s %10s %8s %8s %8s\n", "arena", "chunks", "empty",
+            "live KiB", "free KiB", "cache KiB", "over KiB", "largest", "ext", "block");
+    for (int a = 0; a <= report->arena_count; a++)
+    {
+        om_arena_report *ar = a < report->arena_count ? &report->arenas[a] : &report->total;
+        char name[16];
+        snprintf(name, sizeof(name), a < report->arena_count ? "%d" : "total", a);
+        fprintf(stderr, "%-6s %8ld %8ld %10zu %10zu %10zu %10zu %8zu %7.1f%% %7.1f%%\n", name,
+                ar->chunks, ar->empty_chunks, ar->live_bytes / 1024, ar->free_bytes / 1024,
+                ar->cached_bytes / 1024, ar->overhead_bytes / 1024, ar->largest_free,
+                100.0 * ar->external_frag, 100.0 * ar->block_frag);
+    }
+    fprintf(stderr, "Large:      %ld live, %zu KiB mapped for %zu KiB asked\n",
+            report->large_count, report->large_bytes / 1024, report->large_requested / 1024);
+    fprintf(stderr, "Cached:     %ld mappings, %zu KiB\n",
+            report->large_cached, report->large_cached_bytes / 1024);
+    fprintf(stderr, "Waste:      %.1f%% of %zu KiB held is overhead\n",
+            100.0 * report->total.internal_waste, report->total.held_bytes / 1024);
 }
@@ -1,8 +1,14 @@
 #ifndef OMEM_H
 #define OMEM_H
 
+#include <stddef.h>
+
 // Optimized Malloc Interface
 
+#define OM_MAX_CLASSES 64
+#define OM_MAX_NODES 64
+#define OM_MAX_ARENAS 64
+
 typedef struct om_stats
 {
     long pages_mapped;
@@ -10,13 +16,120 @@ typedef struct om_stats
     long chunks_allocated;
     long chunks_freed;
     long free_length;
+    long mmap_calls;
+    long bytes_in_use;
+    long bytes_mapped;
+    long lock_acquired;
+    long lock_contended;
+    long tcache_hits;
+    long tcache_misses;
+    long batch_hits;
+    long large_hits;
+    long large_misses;
+    int class_count;
+    long class_size[OM_MAX_CLASSES]; // 0 for the block and large classes
+    long class_allocs[OM_MAX_CLASSES];
+    long class_frees[OM_MAX_CLASSES];
+    int node_count;
+    long node_arenas[OM_MAX_NODES];
+    long node_pages[OM_MAX_NODES];        // chunk pages held by its arenas
+    long node_remote_frees[OM_MAX_NODES]; // frees from threads on other nodes
 } om_stats;
 
 om_stats *ogetstats();
 void oprintstats();
 
 void *omalloc(size_t size);
+void *ocalloc(size_t nmemb, size_t size);
 void ofree(void *item);
+void ofree_sized(void *item, size_t size);
 void *orealloc(void *prev, size_t bytes);
+void *oaligned_alloc(size_t align, size_t size);
+int oposix_memalign(void **out, size_t align, size_t size);
+size_t ousable_size(void *ptr);
+size_t omalloc_bulk(size_t size, size_t count, void **out);
+void ofree_bulk(void **ptrs, size_t count);
+
+// Fixed-size object pools.
+typedef struct opool opool;
+opool *opool_create(size_t obj_size);
+void *opool_alloc(opool *pool);
+void opool_free(opool *pool, void *obj);
+void *opool_alloc_chain(opool *pool, size_t count); // linked via first word
+void opool_free_chain(opool *pool, void *head, size_t link_offset);
+
+// Heap profiling, enabled with OMEM_PROF_RATE. Writes a pprof heap
+// profile to path, or to an automatically named file if path is NULL.
+int oprof_dump(const char *path);
+
+// Heap walking. oheap_walk() calls visit once for every chunk of every
+// arena and every large mapping, locking one arena at a time and never
+// while visit runs. For each chunk live_bytes + free_bytes +
+// overhead_bytes == size. Slab objects sitting in thread caches count
+// as live here; oheap_report() moves them to free.
+enum
+{
+    OM_CHUNK_SLAB,   // objects of one size class
+    OM_CHUNK_BLOCK,  // variable-sized cells
+    OM_CHUNK_EMPTY,  // nothing allocated, kept for reuse
+    OM_CHUNK_LARGE,  // one large allocation
+    OM_CHUNK_CACHED, // a freed large mapping kept for reuse
+};
+
+typedef struct om_chunk_info
+{
+    void *addr;
+    size_t size;              // bytes the chunk spans
+    int arena;                // owning arena, -1 for large mappings
+    int kind;
+    size_t obj_size;          // slab: object size; large: bytes asked for
+    long live;                // objects or cells handed out
+    long free;                // objects or cells free to hand out
+    size_t live_bytes;        // usable bytes handed out
+    size_t free_bytes;
+    size_t overhead_bytes;    // descriptors, cell headers, slack, rounding
+    const size_t *free_sizes; // block: the size of each free cell
+} om_chunk_info;
+
+typedef void (*om_walk_fn)(const om_chunk_info *chunk, void *arg);
+void oheap_walk(om_walk_fn visit, void *arg);
+
+// A summary of oheap_walk(). External fragmentation is the share of
+// held memory that is free; internal waste the share that is overhead.
+// For block cells, block_frag is 1 - largest_free / free_cell_bytes, how
+// far the free space is from being one cell. Rounding of small requests
+// up to their slab class or 16 bytes is not seen, since omem does not
+// keep their sizes.
+typedef struct om_arena_report
+{
+    long chunks;              // carved from regions, not released
+    long empty_chunks;
+    long released_chunks;
+    size_t held_bytes;
+    size_t live_bytes;
+    size_t free_bytes;
+    size_t overhead_bytes;
+    size_t cached_bytes;      // of free_bytes, in thread caches and batches
+    size_t free_cell_bytes;
+    size_t largest_free;      // largest free block cell
+    double external_frag;
+    double internal_waste;
+    double block_frag;
+} om_arena_report;
+
+typedef struct om_heap_report
+{
+    int arena_count;
+    om_arena_report arenas[OM_MAX_ARENAS];
+    om_arena_report total;    // arenas and large mappings together
+    long large_count;
+    size_t large_bytes;       // mapped for live large allocations
+    size_t large_requested;
+    long large_cached;
+    size_t large_cached_bytes;
+} om_heap_report;
+
+om_heap_report *oheap_report();
+void oprintheap();
 
 #endif
@@ -5,9 +5,6 @@
 
 #include "xmalloc.h"
 #include "omem.h"
-#include "pthread.h"
-
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 void*
 xmalloc(size_t bytes)
@@ -15,6 +12,12 @@ xmalloc(size_t bytes)
     return omalloc(bytes);
 }
 
+void*
+xcalloc(size_t nmemb, size_t bytes)
+{
+    return ocalloc(nmemb, bytes);
+}
+
 void
 xfree(void* ptr)
 {
@@ -27,3 +30,50 @@ xrealloc(void* prev, size_t bytes)
     return orealloc(prev, bytes);
 }
 
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+    ofree_sized(ptr, bytes);
+}
+
+size_t
+xmalloc_bulk(size_t bytes, size_t count, void** out)
+{
+    return omalloc_bulk(bytes, count, out);
+}
+
+void
+xfree_bulk(void** ptrs, size_t count)
+{
+    ofree_bulk(ptrs, count);
+}
+
+xpool*
+xpool_create(size_t size)
+{
+    return (xpool*)opool_create(size);
+}
+
+void*
+xpool_alloc(xpool* pool)
+{
+    return opool_alloc((opool*)pool);
+}
+
+void
+xpool_free(xpool* pool, void* ptr)
+{
+    opool_free((opool*)pool, ptr);
+}
+
+void*
+xpool_alloc_chain(xpool* pool, size_t count)
+{
+    return opool_alloc_chain((opool*)pool, count);
+}
+
+void
+xpool_free_chain(xpool* pool, void* head, size_t link_offset)
+{
+    opool_free_chain((opool*)pool, head, link_offset);
+}
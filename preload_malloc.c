@@ -0,0 +1,113 @@
+// Replaces the libc allocator with omem, for use as
+//
+//   LD_PRELOAD=./libomem.so some-program
+//
+// Every entry point glibc exports for the C allocator is defined here so
+// that no pointer from one allocator is ever handed to the other.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "omem.h"
+
+static int
+power_of_two(size_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+static void *
+enomem(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void*
+malloc(size_t bytes)
+{
+    return enomem(omalloc(bytes));
+}
+
+void
+free(void* ptr)
+{
+    ofree(ptr);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+    return enomem(ocalloc(nmemb, size));
+}
+
+void*
+realloc(void* prev, size_t bytes)
+{
+    if (prev != NULL && bytes == 0)
+    {
+        ofree(prev);
+        return NULL;
+    }
+    return enomem(orealloc(prev, bytes));
+}
+
+void*
+reallocarray(void* prev, size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(prev, bytes);
+}
+
+int
+posix_memalign(void** out, size_t align, size_t bytes)
+{
+    return oposix_memalign(out, align, bytes);
+}
+
+void*
+aligned_alloc(size_t align, size_t bytes)
+{
+    if (!power_of_two(align))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return enomem(oaligned_alloc(align, bytes));
+}
+
+void*
+memalign(size_t align, size_t bytes)
+{
+    return aligned_alloc(align, bytes);
+}
+
+void*
+valloc(size_t bytes)
+{
+    return enomem(oaligned_alloc(getpagesize(), bytes));
+}
+
+void*
+pvalloc(size_t bytes)
+{
+    size_t page = getpagesize();
+    return enomem(oaligned_alloc(page, (bytes + page - 1) & ~(page - 1)));
+}
+
+size_t
+malloc_usable_size(void* ptr)
+{
+    return ousable_size(ptr);
+}
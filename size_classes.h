@@ -0,0 +1,31 @@
+// Generated by gen_classes waste12.5; do not edit.
+// 21 classes. Beyond the 16-byte granularity, requests lose at most
+// 12.3% to rounding, and slab chunks at most 10.5% to slack.
+#define SIZE_CLASS_SCHEME "waste12.5"
+#define SLAB_CLASSES 21
+#define SLAB_MAX 512
+#define SLAB_CHUNK_SIZE 4096
+#define SLAB_CHUNK_HEADER 80
+
+static const int64_t slab_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192,
+    208, 224, 256, 288, 320, 352, 400, 448, 512,
+};
+
+// Offset of the first object in a slab chunk of each class, and how
+// many objects fit.
+static const int16_t slab_start[SLAB_CLASSES] = {
+    80, 96, 80, 128, 80, 96, 80, 128, 80, 96, 80, 128,
+    80, 96, 256, 96, 128, 96, 80, 128, 512,
+};
+static const int16_t slab_objects[SLAB_CLASSES] = {
+    251, 125, 83, 62, 50, 41, 35, 31, 27, 25, 22, 20,
+    19, 17, 15, 13, 12, 11, 10, 8, 7,
+};
+
+// Size class for each 16-byte step up to SLAB_MAX.
+static const unsigned char slab_class_of[SLAB_MAX / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    14, 15, 15, 16, 16, 17, 17, 18, 18, 18, 19, 19, 19, 20, 20, 20,
+    20,
+};
@@ -0,0 +1,269 @@
+// Allocator contention stress test.
+//
+// THREADS threads run alloc/free storms over the small size classes.
+// Every block is filled with a stamp unique to that allocation and
+// checked again right before it is freed, so a block handed out twice
+// (or written to after being freed) shows up as a corrupt stamp. Even
+// threads pass half of their blocks to the next thread to free, so
+// memory flows one way: across arenas through the remote-free lists,
+// and within an arena from the freeing thread's cache to the allocating
+// one's, and bursts of a single class spill from thread caches onto
+// the arena's batch stacks. The threads share two arenas so that those
+// stacks are contended. At the end the heap walk must find no block
+// still live.
+//
+// Aligned allocation and realloc are checked on their own first. While
+// the threads run, the main thread walks the heap and checks that every
+// chunk adds up.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "omem.h"
+
+#define THREADS 64
+#define ROUNDS 200
+#define LIVE 256
+#define HANDOFF 64
+#define BURST 192
+#define WALKS 20
+
+typedef struct stress_block {
+    uint64_t stamp;
+    size_t   size;
+} stress_block;
+
+// A block with the stamp and size it was made with, to check against.
+typedef struct stress_ref {
+    stress_block* bb;
+    uint64_t      stamp;
+    size_t        size;
+} stress_ref;
+
+typedef struct stress_mailbox {
+    stress_ref    slots[HANDOFF];
+    int           count;
+    pthread_mutex_t lock;
+} stress_mailbox;
+
+typedef struct walk_count {
+    long chunks;
+    long bad;
+} walk_count;
+
+stress_mailbox mailboxes[THREADS];
+long failures = 0;
+
+stress_ref
+make_block(uint64_t stamp, size_t size)
+{
+    stress_ref ref = { xmalloc(size), stamp, size };
+    uint64_t* words = (uint64_t*)ref.bb;
+    for (size_t ii = 0; ii < size / sizeof(uint64_t); ++ii) {
+        words[ii] = stamp;
+    }
+    ref.bb->size = size;
+    return ref;
+}
+
+void
+free_block(stress_ref ref)
+{
+    uint64_t* words = (uint64_t*)ref.bb;
+    int ok = ref.bb->stamp == ref.stamp && ref.bb->size == ref.size;
+    for (size_t ii = 2; ok && ii < ref.size / sizeof(uint64_t); ++ii) {
+        ok = words[ii] == ref.stamp;
+    }
+    if (!ok) {
+        __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+    }
+    xfree(ref.bb);
+}
+
+void
+drain_mailbox(stress_mailbox* mb)
+{
+    pthread_mutex_lock(&(mb->lock));
+    for (int ii = 0; ii < mb->count; ++ii) {
+        free_block(mb->slots[ii]);
+    }
+    mb->count = 0;
+    pthread_mutex_unlock(&(mb->lock));
+}
+
+void*
+storm(void* arg)
+{
+    long id = (long)arg;
+    unsigned seed = (unsigned)id * 7919 + 1;
+    uint64_t serial = 0;
+    stress_ref live[LIVE];
+    stress_mailbox* next = &(mailboxes[(id + 1) % THREADS]);
+
+    for (int rr = 0; rr < ROUNDS; ++rr) {
+        for (int ii = 0; ii < LIVE; ++ii) {
+            size_t size = 16 + 16 * (rand_r(&seed) % 32);
+            live[ii] = make_block(((uint64_t)id << 40) | serial++, size);
+        }
+
+        for (int ii = 0; ii < LIVE; ++ii) {
+            if (ii % 2 == 0 || id % 2 == 1) {
+                free_block(live[ii]);
+                continue;
+            }
+
+            int passed = 0;
+            pthread_mutex_lock(&(next->lock));
+            if (next->count < HANDOFF) {
+                next->slots[next->count++] = live[ii];
+                passed = 1;
+            }
+            pthread_mutex_unlock(&(next->lock));
+            if (!passed) {
+                free_block(live[ii]);
+            }
+        }
+
+        drain_mailbox(&(mailboxes[id]));
+
+        // More of one class than a thread cache keeps, so that it
+        // spills batches onto the arena's stack for others to take.
+        stress_ref burst[BURST];
+        size_t size = 16 + 16 * (rr % 4);
+        for (int ii = 0; ii < BURST; ++ii) {
+            burst[ii] = make_block(((uint64_t)id << 40) | serial++, size);
+        }
+        for (int ii = 0; ii < BURST; ++ii) {
+            free_block(burst[ii]);
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+void
+check_chunk(const om_chunk_info* chunk, void* arg)
+{
+    walk_count* wc = (walk_count*)arg;
+    wc->chunks += 1;
+    if (chunk->live_bytes + chunk->free_bytes + chunk->overhead_bytes != chunk->size) {
+        wc->bad += 1;
+    }
+}
+
+void
+fill(unsigned char* buf, size_t size, unsigned seed)
+{
+    for (size_t ii = 0; ii < size; ++ii) {
+        buf[ii] = (unsigned char)(ii * 31 + seed);
+    }
+}
+
+int
+filled(unsigned char* buf, size_t size, unsigned seed)
+{
+    for (size_t ii = 0; ii < size; ++ii) {
+        if (buf[ii] != (unsigned char)(ii * 31 + seed)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Aligned blocks from 32 bytes to 2 MiB must come back aligned, through
+// both entry points, and keep their contents through a grow and a
+// shrink. Returns the number of failures.
+long
+check_aligned()
+{
+    static const size_t sizes[] = {1, 100, 3000, 70000};
+    long bad = 0;
+
+    for (size_t align = 32; align <= (2 << 20); align *= 2) {
+        for (int ii = 0; ii < 4; ++ii) {
+            size_t size = sizes[ii];
+            unsigned seed = (unsigned)(align + ii);
+
+            unsigned char* pp = oaligned_alloc(align, size);
+            void* qq = 0;
+            if (!pp || ((uintptr_t)pp & (align - 1)) != 0) {
+                bad += 1;
+                continue;
+            }
+            if (oposix_memalign(&qq, align, size) != 0 || ((uintptr_t)qq & (align - 1)) != 0) {
+                bad += 1;
+            }
+            ofree(qq);
+
+            fill(pp, size, seed);
+            pp = orealloc(pp, size * 3 + 100);
+            if (!pp || !filled(pp, size, seed)) {
+                bad += 1;
+                ofree(pp);
+                continue;
+            }
+            pp = orealloc(pp, size / 2 + 1);
+            if (!pp || !filled(pp, size / 2 + 1, seed)) {
+                bad += 1;
+            }
+            ofree(pp);
+        }
+    }
+    return bad;
+}
+
+int
+main()
+{
+    pthread_t threads[THREADS];
+    walk_count walked = {0, 0};
+
+    // One arena per CPU would give most threads an arena of their own.
+    setenv("OMEM_ARENAS", "2", 1);
+
+    long misaligned = check_aligned();
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        pthread_mutex_init(&(mailboxes[ii].lock), 0);
+    }
+
+    for (long ii = 0; ii < THREADS; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, storm, (void*)ii);
+        if (rv != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    for (int ii = 0; ii < WALKS; ++ii) {
+        oheap_walk(check_chunk, &walked);
+        sched_yield();
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        pthread_join(threads[ii], 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        drain_mailbox(&(mailboxes[ii]));
+    }
+
+    om_stats* stats = ogetstats();
+    om_heap_report* heap = oheap_report();
+
+    printf("Corrupt blocks: %ld\n", failures);
+    printf("Misaligned or lost in realloc: %ld\n", misaligned);
+    printf("Chunks walked: %ld, not adding up: %ld\n", walked.chunks, walked.bad);
+    printf("Batch stack hits: %ld\n", stats->batch_hits);
+    printf("Left live: %zu bytes, %ld large\n", heap->total.live_bytes, heap->large_count);
+    if (failures == 0 && misaligned == 0 && walked.bad == 0 && stats->batch_hits > 0
+        && heap->total.live_bytes == 0 && heap->large_count == 0) {
+        printf("Stress ok\n");
+    }
+    return 0;
+}
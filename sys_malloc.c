@@ -12,6 +12,12 @@ xmalloc(size_t bytes)
     return malloc(bytes);
 }
 
+void*
+xcalloc(size_t nmemb, size_t bytes)
+{
+    return calloc(nmemb, bytes);
+}
+
 void
 xfree(void* ptr)
 {
@@ -24,3 +30,80 @@ xrealloc(void* prev, size_t bytes)
     return realloc(prev, bytes);
 }
 
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+    (void)bytes;
+    xfree(ptr);
+}
+
+size_t
+xmalloc_bulk(size_t bytes, size_t count, void** out)
+{
+    for (size_t ii = 0; ii < count; ++ii) {
+        out[ii] = xmalloc(bytes);
+        if (!out[ii]) {
+            return ii;
+        }
+    }
+    return count;
+}
+
+void
+xfree_bulk(void** ptrs, size_t count)
+{
+    for (size_t ii = 0; ii < count; ++ii) {
+        if (ptrs[ii]) {
+            xfree(ptrs[ii]);
+        }
+    }
+}
+
+// No pools in this allocator: a pool is just its object size.
+struct xpool {
+    size_t size;
+};
+
+xpool*
+xpool_create(size_t size)
+{
+    xpool* pool = xmalloc(sizeof(xpool));
+    pool->size = size;
+    return pool;
+}
+
+void*
+xpool_alloc(xpool* pool)
+{
+    return xmalloc(pool->size);
+}
+
+void
+xpool_free(xpool* pool, void* ptr)
+{
+    (void)pool;
+    xfree(ptr);
+}
+
+void*
+xpool_alloc_chain(xpool* pool, size_t count)
+{
+    void* head = 0;
+    for (size_t ii = 0; ii < count; ++ii) {
+        void* obj = xmalloc(pool->size);
+        *(void**)obj = head;
+        head = obj;
+    }
+    return head;
+}
+
+void
+xpool_free_chain(xpool* pool, void* head, size_t link_offset)
+{
+    (void)pool;
+    while (head) {
+        void* next = *(void**)(head + link_offset);
+        xfree(head);
+        head = next;
+    }
+}
@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 13;
+use Test::Simple tests => 15;
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -65,6 +65,12 @@ my $pl_ok = $par_l =~ /at 871: 178 steps/;
 ok($pl_ok, "list-par 1k");
 ok($pl_ok && $t_pl < $t_sl, "list-par beat system time");
 
+my $stress = run_prog("stress-par", "");
+ok($stress =~ /Stress ok/, "stress-par 64 threads");
+
+my $pre_v = `LD_PRELOAD=./libomem.so ./collatz-ivec-sys 1000`;
+ok($pre_v =~ /at 871: 178 steps/, "ivec-sys 1k with libomem.so preloaded");
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;
@@ -86,6 +92,6 @@ sub crc_check {
     return $crc eq $expect;
 }
 
-ok(crc_check("ivec_main.c", "cae7f5aa"), "ivec_main unchanged");
-ok(crc_check("list_main.c", "0ae6f792"), "list_main unchanged");
+ok(crc_check("ivec_main.c", "2af851b9"), "ivec_main unchanged");
+ok(crc_check("list_main.c", "4cfc370e"), "list_main unchanged");
 
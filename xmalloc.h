@@ -7,4 +7,26 @@ void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
 
+// Allocates nmemb * bytes zeroed bytes, or returns 0 on overflow.
+void* xcalloc(size_t nmemb, size_t bytes);
+
+// Frees ptr, which was allocated (or last reallocated) with bytes.
+void  xfree_sized(void* ptr, size_t bytes);
+
+// Allocates count blocks of bytes each into out[], returning how many
+// were allocated; frees count pointers at once.
+size_t xmalloc_bulk(size_t bytes, size_t count, void** out);
+void   xfree_bulk(void** ptrs, size_t count);
+
+// Pools of fixed-size objects. xpool_alloc_chain returns count objects
+// linked through their first word; xpool_free_chain frees a chain whose
+// objects point to the next one link_offset bytes in.
+typedef struct xpool xpool;
+
+xpool* xpool_create(size_t size);
+void*  xpool_alloc(xpool* pool);
+void   xpool_free(xpool* pool, void* ptr);
+void*  xpool_alloc_chain(xpool* pool, size_t count);
+void   xpool_free_chain(xpool* pool, void* head, size_t link_offset);
+
 #endif